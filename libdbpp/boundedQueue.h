@@ -0,0 +1,74 @@
+#ifndef DB_BOUNDEDQUEUE_H
+#define DB_BOUNDEDQUEUE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+namespace DB {
+	/// Blocking FIFO queue of limited capacity for handing work between threads.
+	template<typename T> class BoundedQueue {
+	public:
+		/// Create a new queue.
+		/// @param capacity Maximum number of items held before push blocks.
+		explicit BoundedQueue(std::size_t capacity) : capacity(capacity ? capacity : 1) { }
+
+		/// Add an item, blocking while the queue is full.
+		/// @return false if the queue has been closed and the item was not added.
+		bool
+		push(T item)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			notFull.wait(lock, [this]() {
+				return closed || items.size() < capacity;
+			});
+			if (closed) {
+				return false;
+			}
+			items.emplace_back(std::move(item));
+			notEmpty.notify_one();
+			return true;
+		}
+
+		/// Remove the next item, blocking while the queue is empty.
+		/// @return the item, or nothing if the queue is closed and drained.
+		std::optional<T>
+		pop()
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			notEmpty.wait(lock, [this]() {
+				return closed || !items.empty();
+			});
+			if (items.empty()) {
+				return {};
+			}
+			std::optional<T> item {std::move(items.front())};
+			items.pop_front();
+			notFull.notify_one();
+			return item;
+		}
+
+		/// Refuse further items and release all waiting threads. Queued items can still be popped.
+		void
+		close()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+			notFull.notify_all();
+			notEmpty.notify_all();
+		}
+
+	private:
+		const std::size_t capacity;
+		std::mutex mutex;
+		std::condition_variable notFull;
+		std::condition_variable notEmpty;
+		std::deque<T> items;
+		bool closed {false};
+	};
+}
+
+#endif
@@ -0,0 +1,241 @@
+#include "bufferedInserter.h"
+#include "connection.h"
+#include "error.h"
+#include "modifycommand.h"
+#include <algorithm>
+#include <buffer.h>
+#include <exception>
+#include <memory>
+#include <string_view>
+#include <utility>
+
+namespace DB {
+	BufferedInserter::BufferedInserter(
+			Connection & c, std::string t, std::vector<std::string> cs, BufferedInserterOptions o) :
+		conn(&c),
+		table(std::move(t)), columns(std::move(cs)), opts(std::move(o))
+	{
+	}
+
+	BufferedInserter::~BufferedInserter() noexcept
+	{
+		if (std::uncaught_exceptions()) {
+			return;
+		}
+		try {
+			flush();
+		}
+		catch (...) {
+			if (opts.onFinalFlushError) {
+				try {
+					opts.onFinalFlushError(std::current_exception());
+				}
+				catch (...) {
+					// The handler has nowhere to report to either
+				}
+			}
+		}
+	}
+
+	BufferedInserter::Row::Row(std::string & b, std::vector<FieldValue> * t) : BulkRowWriter(b)
+	{
+		if (t) {
+			capture.emplace(*t);
+		}
+	}
+
+	void
+	BufferedInserter::Row::null()
+	{
+		BulkRowWriter::null();
+		if (capture) {
+			capture->null();
+		}
+	}
+
+	void
+	BufferedInserter::Row::string(std::string_view v)
+	{
+		BulkRowWriter::string(v);
+		if (capture) {
+			capture->string(v);
+		}
+	}
+
+	void
+	BufferedInserter::Row::integer(int64_t v)
+	{
+		BulkRowWriter::integer(v);
+		if (capture) {
+			capture->integer(v);
+		}
+	}
+
+	void
+	BufferedInserter::Row::boolean(bool v)
+	{
+		BulkRowWriter::boolean(v);
+		if (capture) {
+			capture->boolean(v);
+		}
+	}
+
+	void
+	BufferedInserter::Row::floatingpoint(double v)
+	{
+		BulkRowWriter::floatingpoint(v);
+		if (capture) {
+			capture->floatingpoint(v);
+		}
+	}
+
+	void
+	BufferedInserter::Row::interval(const boost::posix_time::time_duration v)
+	{
+		BulkRowWriter::interval(v);
+		if (capture) {
+			capture->interval(v);
+		}
+	}
+
+	void
+	BufferedInserter::Row::timestamp(const boost::posix_time::ptime v)
+	{
+		BulkRowWriter::timestamp(v);
+		if (capture) {
+			capture->timestamp(v);
+		}
+	}
+
+	void
+	BufferedInserter::Row::blob(const Blob & v)
+	{
+		BulkRowWriter::blob(v);
+		if (capture) {
+			capture->blob(v);
+		}
+	}
+
+	void
+	BufferedInserter::rowAdded()
+	{
+		rows += 1;
+		if (!bulkSupported.value_or(true)) {
+			// Written by type alone; the bulk format only measures it
+			measured += buffer.length();
+			buffer.clear();
+		}
+		const auto now = std::chrono::steady_clock::now();
+		if (!oldest) {
+			oldest = now;
+		}
+		if (rows >= opts.maxRows || pendingBytes() >= opts.maxBytes || now - *oldest >= opts.maxAge) {
+			flush();
+		}
+	}
+
+	std::size_t
+	BufferedInserter::flush()
+	{
+		if (!rows) {
+			return 0;
+		}
+		if (bulkSupported.value_or(true)) {
+			try {
+				flushBulk();
+				bulkSupported = true;
+			}
+			catch (const BulkUploadNotSupported &) {
+				bulkSupported = false;
+			}
+		}
+		const auto flushed = rows;
+		if (!*bulkSupported) {
+			flushInserts();
+		}
+		clear();
+		return flushed;
+	}
+
+	void
+	BufferedInserter::commitTx()
+	{
+		flush();
+		conn->commitTx();
+	}
+
+	void
+	BufferedInserter::clear()
+	{
+		buffer.clear();
+		typed.clear();
+		rows = 0;
+		measured = 0;
+		oldest.reset();
+	}
+
+	std::size_t
+	BufferedInserter::pendingRows() const
+	{
+		return rows;
+	}
+
+	std::size_t
+	BufferedInserter::pendingBytes() const
+	{
+		return buffer.length() + measured;
+	}
+
+	void
+	BufferedInserter::flushBulk()
+	{
+		conn->beginBulkUpload(bulkUploadTarget(table, columns).c_str(), opts.uploadOptions.c_str());
+		try {
+			conn->bulkUploadData(buffer.data(), buffer.length());
+		}
+		catch (const std::exception & e) {
+			abortBulkUpload(*conn, e.what());
+			throw;
+		}
+		catch (...) {
+			abortBulkUpload(*conn, "BufferedInserter flush failed");
+			throw;
+		}
+		conn->endBulkUpload(nullptr);
+	}
+
+	void
+	BufferedInserter::flushInserts()
+	{
+		// Inserts are written from the typed values alone
+		measured += buffer.length();
+		buffer.clear();
+		const auto perInsert = std::max<std::size_t>(1, opts.rowsPerInsert);
+		while (rows > 0) {
+			const auto batch = std::min(rows, perInsert);
+			AdHoc::Buffer sql;
+			sql.appendbf("INSERT INTO %s(", table);
+			for (auto c = columns.begin(); c != columns.end(); ++c) {
+				sql.appendbf(c == columns.begin() ? "%s" : ", %s", *c);
+			}
+			sql.append(") VALUES ");
+			for (std::size_t r = 0; r < batch; r++) {
+				sql.append(r ? ", (" : "(");
+				for (std::size_t c = 0; c < columns.size(); c++) {
+					sql.append(c ? ", ?" : "?");
+				}
+				sql.append(")");
+			}
+			auto ins = conn->modify(sql);
+			const auto values = std::min(typed.size(), batch * columns.size());
+			for (std::size_t v = 0; v < values; v++) {
+				bindFieldValue(*ins, static_cast<unsigned int>(v), typed[v]);
+			}
+			ins->execute();
+			// Written rows leave the buffer, so a later failure only retains the rest
+			typed.erase(typed.begin(), typed.begin() + static_cast<std::ptrdiff_t>(values));
+			measured -= measured * batch / rows;
+			rows -= batch;
+		}
+	}
+}
@@ -0,0 +1,123 @@
+#ifndef DB_BUFFEREDINSERTER_H
+#define DB_BUFFEREDINSERTER_H
+
+#include "bulkRowWriter.h"
+#include <c++11Helpers.h>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <visibility.h>
+
+namespace DB {
+	class Connection;
+
+	/// Thresholds and options controlling a BufferedInserter.
+	struct BufferedInserterOptions {
+		/// Flush once this many rows are buffered.
+		std::size_t maxRows {10000};
+		/// Flush once the buffered rows occupy this many bytes.
+		std::size_t maxBytes {4 * 1024 * 1024};
+		/// Flush once the oldest buffered row is this old. Only checked when a row is added, so rows buffered
+		/// before adding stops wait for an explicit flush().
+		std::chrono::milliseconds maxAge {1000};
+		/// Database specific options to the bulk upload command.
+		std::string uploadOptions;
+		/// Rows per statement when falling back to multi-row inserts.
+		std::size_t rowsPerInsert {500};
+		/// Called with the failure if the flush on destruction fails (the buffered rows are lost).
+		std::function<void(std::exception_ptr)> onFinalFlushError;
+	};
+
+	/// Write-behind buffer which collects rows for a table and writes them in batches.
+	/// Rows are held in bulk upload format and written with a single bulk upload per flush, or with multi-row
+	/// INSERT statements when the connector does not support bulk upload. Until a flush shows which, rows are
+	/// also held by type, so the inserts bind each value as given. A flush happens automatically when any
+	/// threshold is reached as a row is added, explicitly via flush(), or before committing via commitTx(). If
+	/// a flush fails the exception propagates and the unwritten rows remain buffered.
+	/// Committing directly on the connection does not flush; use this class's commitTx(), or call flush() first.
+	class DLL_PUBLIC BufferedInserter {
+	public:
+		/// Create a new inserter.
+		/// @param conn The connection to write to.
+		/// @param table The target table.
+		/// @param columns The target columns, in the order values are given to add() (required by the insert
+		/// fallback).
+		/// @param opts Thresholds and options.
+		BufferedInserter(Connection & conn, std::string table, std::vector<std::string> columns,
+				BufferedInserterOptions opts = {});
+		/// Flushes any remaining rows unless unwinding due to an exception. A failure is passed to
+		/// BufferedInserterOptions::onFinalFlushError, if set, as it cannot be thrown from here.
+		~BufferedInserter() noexcept;
+		/// Standard special members
+		SPECIAL_MEMBERS_COPY(BufferedInserter, delete);
+		/// Standard special members
+		SPECIAL_MEMBERS_MOVE(BufferedInserter, delete);
+
+		/// Buffer a row, one value per column, flushing if a threshold is reached.
+		template<typename... Values>
+		void
+		add(const Values &... values)
+		{
+			Row row(buffer, bulkSupported.value_or(false) ? nullptr : &typed);
+			(row.value(values), ...);
+			row.endRow();
+			rowAdded();
+		}
+
+		/// Write all buffered rows to the database.
+		/// @return The number of rows written.
+		std::size_t flush();
+		/// Flush all buffered rows and then commit the connection's transaction.
+		void commitTx();
+		/// Discard all buffered rows without writing them.
+		void clear();
+
+		/// The number of rows currently buffered.
+		[[nodiscard]] std::size_t pendingRows() const;
+		/// The size of the rows currently buffered.
+		[[nodiscard]] std::size_t pendingBytes() const;
+
+	private:
+		/// Bulk upload row writer which also captures the values by type, when given a list to add them to.
+		class DLL_PUBLIC Row : public BulkRowWriter {
+		public:
+			Row(std::string & buffer, std::vector<FieldValue> * typed);
+
+			void null() override;
+			void string(std::string_view) override;
+			void integer(int64_t) override;
+			void boolean(bool) override;
+			void floatingpoint(double) override;
+			void interval(const boost::posix_time::time_duration) override;
+			void timestamp(const boost::posix_time::ptime) override;
+			void blob(const Blob &) override;
+
+		private:
+			std::optional<CaptureFieldValue> capture;
+		};
+
+		DLL_PRIVATE void rowAdded();
+		DLL_PRIVATE void flushBulk();
+		DLL_PRIVATE void flushInserts();
+
+		Connection * conn;
+		std::string table;
+		std::vector<std::string> columns;
+		BufferedInserterOptions opts;
+		std::string buffer;
+		// Only while bulk upload isn't known to work
+		std::vector<FieldValue> typed;
+		std::size_t rows {0};
+		// Size of rows measured but not kept in bulk upload format, once it's known not to be supported
+		std::size_t measured {0};
+		std::optional<std::chrono::steady_clock::time_point> oldest;
+		std::optional<bool> bulkSupported;
+	};
+}
+
+#endif
@@ -0,0 +1,229 @@
+#include "bulkRowWriter.h"
+#include "command.h"
+#include "connection.h"
+#include <array>
+#include <buffer.h>
+#include <charconv>
+#include <cstddef>
+
+namespace DB {
+	BulkRowWriter::BulkRowWriter(std::string & b, BulkBlobFormat bf) : buffer(b), blobFormat(bf) { }
+
+	void
+	BulkRowWriter::column(const Column & c)
+	{
+		c.apply(*this);
+	}
+
+	void
+	BulkRowWriter::endRow()
+	{
+		buffer += '\n';
+		rowStarted = false;
+	}
+
+	void
+	BulkRowWriter::separate()
+	{
+		if (rowStarted) {
+			buffer += '\t';
+		}
+		rowStarted = true;
+	}
+
+	void
+	BulkRowWriter::escaped(std::string_view v)
+	{
+		static constexpr std::string_view special {"\\\t\n\r\0", 5};
+		for (std::string_view::size_type s; (s = v.find_first_of(special)) != std::string_view::npos;
+				v.remove_prefix(s + 1)) {
+			buffer.append(v.substr(0, s));
+			buffer += '\\';
+			switch (v[s]) {
+				case '\t':
+					buffer += 't';
+					break;
+				case '\n':
+					buffer += 'n';
+					break;
+				case '\r':
+					buffer += 'r';
+					break;
+				case '\0':
+					buffer += '0';
+					break;
+				default:
+					buffer += '\\';
+					break;
+			}
+		}
+		buffer.append(v);
+	}
+
+	void
+	BulkRowWriter::null()
+	{
+		separate();
+		buffer.append("\\N");
+	}
+
+	void
+	BulkRowWriter::string(std::string_view v)
+	{
+		separate();
+		escaped(v);
+	}
+
+	void
+	BulkRowWriter::integer(int64_t v)
+	{
+		separate();
+		std::array<char, 24> buf {};
+		const auto r = std::to_chars(buf.begin(), buf.end(), v);
+		buffer.append(buf.begin(), r.ptr);
+	}
+
+	void
+	BulkRowWriter::boolean(bool v)
+	{
+		separate();
+		buffer += v ? '1' : '0';
+	}
+
+	void
+	BulkRowWriter::floatingpoint(double v)
+	{
+		separate();
+		std::array<char, 32> buf {};
+		const auto r = std::to_chars(buf.begin(), buf.end(), v);
+		buffer.append(buf.begin(), r.ptr);
+	}
+
+	void
+	BulkRowWriter::interval(const boost::posix_time::time_duration v)
+	{
+		separate();
+		buffer.append(boost::posix_time::to_simple_string(v));
+	}
+
+	void
+	BulkRowWriter::timestamp(const boost::posix_time::ptime v)
+	{
+		separate();
+		auto ts = boost::posix_time::to_iso_extended_string(v);
+		if (const auto t = ts.find('T'); t != std::string::npos) {
+			ts[t] = ' ';
+		}
+		buffer.append(ts);
+	}
+
+	void
+	BulkRowWriter::blob(const Blob & v)
+	{
+		static constexpr std::string_view hex {"0123456789abcdef"};
+		separate();
+		if (blobFormat == BulkBlobFormat::Escaped) {
+			escaped({static_cast<const char *>(v.data), v.len});
+			return;
+		}
+		buffer.append("\\\\x");
+		buffer.reserve(buffer.length() + (v.len * 2));
+		const auto bytes = static_cast<const unsigned char *>(v.data);
+		for (std::size_t i = 0; i < v.len; i++) {
+			buffer += hex[bytes[i] >> 4U];
+			buffer += hex[bytes[i] & 0xFU];
+		}
+	}
+
+	CaptureFieldValue::CaptureFieldValue(std::vector<FieldValue> & v) : values(v) { }
+
+	void
+	CaptureFieldValue::null()
+	{
+		values.emplace_back(nullptr);
+	}
+
+	void
+	CaptureFieldValue::string(std::string_view v)
+	{
+		values.emplace_back(std::string {v});
+	}
+
+	void
+	CaptureFieldValue::integer(int64_t v)
+	{
+		values.emplace_back(v);
+	}
+
+	void
+	CaptureFieldValue::boolean(bool v)
+	{
+		values.emplace_back(v);
+	}
+
+	void
+	CaptureFieldValue::floatingpoint(double v)
+	{
+		values.emplace_back(v);
+	}
+
+	void
+	CaptureFieldValue::interval(const boost::posix_time::time_duration v)
+	{
+		values.emplace_back(v);
+	}
+
+	void
+	CaptureFieldValue::timestamp(const boost::posix_time::ptime v)
+	{
+		values.emplace_back(v);
+	}
+
+	void
+	CaptureFieldValue::blob(const Blob & v)
+	{
+		const auto bytes = static_cast<const unsigned char *>(v.data);
+		values.emplace_back(std::vector<unsigned char>(bytes, bytes + v.len));
+	}
+
+	void
+	bindFieldValue(Command & cmd, unsigned int i, const FieldValue & value)
+	{
+		std::visit(
+				[&cmd, i](const auto & v) {
+					if constexpr (std::is_same_v<std::decay_t<decltype(v)>, std::vector<unsigned char>>) {
+						cmd.bindParamBLOB(i, Blob {v.data(), v.size()});
+					}
+					else {
+						cmd.bindParam(i, v);
+					}
+				},
+				value);
+	}
+
+	std::string
+	bulkUploadTarget(const std::string & table, const std::vector<std::string> & columns)
+	{
+		AdHoc::Buffer target;
+		target.append(table);
+		if (!columns.empty()) {
+			target.append("(");
+			for (auto c = columns.begin(); c != columns.end(); ++c) {
+				target.appendbf(c == columns.begin() ? "%s" : ", %s", *c);
+			}
+			target.append(")");
+		}
+		return target;
+	}
+
+	void
+	abortBulkUpload(Connection & conn, const char * reason) noexcept
+	{
+		try {
+			conn.endBulkUpload(reason);
+		}
+		catch (...) {
+			// The original failure is more interesting
+		}
+	}
+}
@@ -0,0 +1,153 @@
+#ifndef DB_BULKROWWRITER_H
+#define DB_BULKROWWRITER_H
+
+#include "column.h"
+#include "dbTypes.h"
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <cstdint>
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wold-style-cast"
+#pragma GCC diagnostic ignored "-Wsign-conversion"
+#ifndef __clang__
+#	pragma GCC diagnostic ignored "-Wuseless-cast"
+#endif
+#include <glibmm/ustring.h>
+#pragma GCC diagnostic pop
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <variant>
+#include <vector>
+#include <visibility.h>
+
+namespace DB {
+	class Command;
+	class Connection;
+
+	/// How binary values are written in bulk upload data.
+	enum class BulkBlobFormat {
+		/// As PostgreSQL's bytea hex form (\\x followed by two hex digits per byte).
+		Hex,
+		/// As the raw bytes, escaped like text (as MySQL's LOAD DATA expects).
+		Escaped,
+	};
+
+	/// Field handler which encodes rows in the tab delimited text format accepted by bulk uploads.
+	/// Nulls are written as \\N and backslash, tab, newline, carriage return and NUL are escaped.
+	class DLL_PUBLIC BulkRowWriter : public HandleField {
+	public:
+		/// Create a new writer appending to the given buffer.
+		/// @param buffer The buffer to append to.
+		/// @param blobFormat How to write binary values.
+		explicit BulkRowWriter(std::string & buffer, BulkBlobFormat blobFormat = BulkBlobFormat::Hex);
+
+		/// Append the current value of a column.
+		void column(const Column &);
+		/// Terminate the current row.
+		void endRow();
+
+		/// Append a value by type based on C++ traits.
+		template<typename T>
+		inline void
+		value(const T & v)
+		{
+			if constexpr (std::is_null_pointer<T>::value || std::is_same<T, std::nullopt_t>::value) {
+				null();
+			}
+			else if constexpr (std::is_same<T, bool>::value) {
+				boolean(v);
+			}
+			else if constexpr (std::is_floating_point<T>::value) {
+				floatingpoint(static_cast<double>(v));
+			}
+			else if constexpr (std::is_same<T, boost::posix_time::time_duration>::value) {
+				interval(v);
+			}
+			else if constexpr (std::is_same<T, boost::posix_time::ptime>::value) {
+				timestamp(v);
+			}
+			else if constexpr (std::is_same<T, Blob>::value || std::is_convertible<T, Blob>::value) {
+				blob(v);
+			}
+			else if constexpr (std::is_integral<T>::value && !std::is_pointer<T>::value) {
+				integer(static_cast<int64_t>(v));
+			}
+			else if constexpr (std::is_convertible<T, std::string_view>::value && std::is_pointer<T>::value) {
+				if (v) {
+					string(v);
+				}
+				else {
+					null();
+				}
+			}
+			else if constexpr (std::is_same<T, Glib::ustring>::value) {
+				string(v.raw());
+			}
+			else if constexpr (std::is_convertible<T, std::string_view>::value) {
+				string(v);
+			}
+			else if constexpr (std::is_constructible<bool, const T &>::value) {
+				if (v) {
+					value(*v);
+				}
+				else {
+					null();
+				}
+			}
+			else {
+				static_assert(std::is_void_v<T>, "No suitable trait");
+			}
+		}
+
+		void null() override;
+		void string(std::string_view) override;
+		void integer(int64_t) override;
+		void boolean(bool) override;
+		void floatingpoint(double) override;
+		void interval(const boost::posix_time::time_duration) override;
+		void timestamp(const boost::posix_time::ptime) override;
+		void blob(const Blob &) override;
+
+	private:
+		DLL_PRIVATE void separate();
+		DLL_PRIVATE void escaped(std::string_view);
+
+		std::string & buffer;
+		const BulkBlobFormat blobFormat;
+		bool rowStarted {false};
+	};
+
+	/// A field's value, held by type.
+	using FieldValue = std::variant<std::nullptr_t, std::string, int64_t, bool, double,
+			boost::posix_time::time_duration, boost::posix_time::ptime, std::vector<unsigned char>>;
+
+	/// Field handler which appends each value it's given, by type, to a list.
+	class DLL_PUBLIC CaptureFieldValue : public HandleField {
+	public:
+		/// Create a new handler appending to the given list.
+		explicit CaptureFieldValue(std::vector<FieldValue> & values);
+
+		void null() override;
+		void string(std::string_view) override;
+		void integer(int64_t) override;
+		void boolean(bool) override;
+		void floatingpoint(double) override;
+		void interval(const boost::posix_time::time_duration) override;
+		void timestamp(const boost::posix_time::ptime) override;
+		void blob(const Blob &) override;
+
+	private:
+		std::vector<FieldValue> & values;
+	};
+
+	/// Bind a captured value to parameter i of a command.
+	DLL_PUBLIC void bindFieldValue(Command & cmd, unsigned int i, const FieldValue & value);
+
+	/// The target of a bulk upload: the table followed by the column list, if any.
+	DLL_PUBLIC std::string bulkUploadTarget(const std::string & table, const std::vector<std::string> & columns);
+	/// End a failed bulk upload, ignoring any further error (the original failure is more interesting).
+	DLL_PUBLIC void abortBulkUpload(Connection & conn, const char * reason) noexcept;
+}
+
+#endif
@@ -2,13 +2,17 @@
 #include "error.h"
 #include "modifycommand.h"
 #include <array>
+#include <cerrno>
 #include <compileTimeFormatter.h>
 #include <ctime>
 #include <exception>
 #include <factory.impl.h>
+#include <ostream>
 #include <sqlParse.h>
 #include <stdexcept>
 #include <system_error>
+#include <unistd.h>
+#include <utility>
 
 DB::ConnectionError::ConnectionError() : FailureTime(time(nullptr)) { }
 
@@ -18,10 +22,18 @@ DB::TransactionStillOpen::message() const noexcept
 	return "A transaction is still open.";
 }
 
+std::string
+DB::TransactionAlreadyOpen::message() const noexcept
+{
+	return "A transaction is already open.";
+}
+
 void
 DB::Connection::execute(const std::string & sql, const CommandOptionsCPtr & opts)
 {
-	modify(sql, opts)->execute(true);
+	interact([this, &sql, &opts]() {
+		modify(sql, opts)->execute(true);
+	});
 }
 
 void
@@ -37,44 +49,48 @@ AdHocFormatter(SavePointFmt, "tx_sp_%?_%?");
 void
 DB::Connection::beginTx()
 {
-	if (inTx()) {
-		savepoint(SavePointFmt::get(this, txOpenDepth));
-	}
-	else {
-		beginTxInt();
-	}
+	interact([this]() {
+		if (inTx()) {
+			savepoint(SavePointFmt::get(this, txOpenDepth));
+		}
+		else {
+			beginTxInt();
+		}
+	});
 	txOpenDepth += 1;
 }
 
 void
 DB::Connection::commitTx()
 {
-	switch (txOpenDepth) {
-		case 0:
-			throw TransactionRequired();
-		case 1:
+	if (!txOpenDepth) {
+		throw TransactionRequired();
+	}
+	interact([this]() {
+		if (txOpenDepth == 1) {
 			commitTxInt();
-			break;
-		default:
+		}
+		else {
 			releaseSavepoint(SavePointFmt::get(this, txOpenDepth - 1));
-			break;
-	}
+		}
+	});
 	txOpenDepth -= 1;
 }
 
 void
 DB::Connection::rollbackTx()
 {
-	switch (txOpenDepth) {
-		case 0:
-			throw TransactionRequired();
-		case 1:
+	if (!txOpenDepth) {
+		throw TransactionRequired();
+	}
+	interact([this]() {
+		if (txOpenDepth == 1) {
 			rollbackTxInt();
-			break;
-		default:
+		}
+		else {
 			rollbackToSavepoint(SavePointFmt::get(this, txOpenDepth - 1));
-			break;
-	}
+		}
+	});
 	txOpenDepth -= 1;
 }
 
@@ -84,6 +100,36 @@ DB::Connection::inTx() const
 	return txOpenDepth > 0;
 }
 
+std::chrono::steady_clock::time_point
+DB::Connection::lastActivity() const
+{
+	return activity;
+}
+
+void
+DB::Connection::markActivity() const
+{
+	activity = std::chrono::steady_clock::now();
+}
+
+void
+DB::Connection::markFailure() const
+{
+	failure = true;
+}
+
+bool
+DB::Connection::hasFailed() const
+{
+	return failure;
+}
+
+std::chrono::steady_clock::time_point
+DB::Connection::opened() const
+{
+	return openedAt;
+}
+
 void
 DB::Connection::executeScript(std::istream & f, const std::filesystem::path & s)
 {
@@ -91,6 +137,18 @@ DB::Connection::executeScript(std::istream & f, const std::filesystem::path & s)
 	p.Execute();
 }
 
+DB::BulkUpsertStyle
+DB::Connection::bulkUpsertStyle() const
+{
+	return BulkUpsertStyle::None;
+}
+
+DB::ReturningStyle
+DB::Connection::returningStyle() const
+{
+	return ReturningStyle::None;
+}
+
 void
 DB::Connection::savepoint(const std::string & sp)
 {
@@ -160,6 +218,71 @@ DB::Connection::bulkUploadData(FILE * in) const
 	return total;
 }
 
+void
+DB::Connection::beginBulkDownload(const char *, const char *)
+{
+	throw DB::BulkDownloadNotSupported();
+}
+
+void
+DB::Connection::endBulkDownload(const char *)
+{
+	throw DB::BulkDownloadNotSupported();
+}
+
+size_t
+DB::Connection::bulkDownloadData(const BulkDownloadSink &) const
+{
+	throw DB::BulkDownloadNotSupported();
+}
+
+size_t
+DB::Connection::bulkDownloadData(std::ostream & out) const
+{
+	if (!out.good()) {
+		throw std::runtime_error("Output stream is not good");
+	}
+	return bulkDownloadData([&out](const char * data, size_t len) {
+		if (!out.write(data, static_cast<std::streamsize>(len))) {
+			throw std::runtime_error("Output stream is not good");
+		}
+	});
+}
+
+size_t
+DB::Connection::bulkDownloadData(FILE * out) const
+{
+	if (!out) {
+		throw std::runtime_error("Output file handle is null");
+	}
+	return bulkDownloadData([out](const char * data, size_t len) {
+		if (fwrite(data, 1, len, out) != len) {
+			throw std::system_error(errno, std::system_category());
+		}
+	});
+}
+
+size_t
+DB::Connection::bulkDownloadData(int fd) const
+{
+	if (fd < 0) {
+		throw std::runtime_error("Output file descriptor is invalid");
+	}
+	return bulkDownloadData([fd](const char * data, size_t len) {
+		while (len > 0) {
+			const auto w = write(fd, data, len);
+			if (w < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				throw std::system_error(errno, std::system_category());
+			}
+			data += w;
+			len -= static_cast<size_t>(w);
+		}
+	});
+}
+
 AdHocFormatter(PluginLibraryFormat, "libdbpp-%?.so");
 std::optional<std::string>
 DB::Connection::resolvePlugin(const std::type_info &, const std::string_view name)
@@ -179,15 +302,30 @@ DB::TransactionRequired::message() const noexcept
 	return "A transaction must be opened before performing this operation";
 }
 
-DB::TransactionScope::TransactionScope(DB::Connection & c) : conn(&c)
+// Innermost TransactionScope's connection, per thread
+static thread_local DB::Connection * currentTransaction = nullptr;
+
+DB::TransactionScope::TransactionScope(DB::Connection & c) : conn(&c), outer(currentTransaction)
 {
 	conn->beginTx();
+	currentTransaction = conn;
+}
+
+// The thread's chain of scopes holds connections, not scopes, so stays as it is
+DB::TransactionScope::TransactionScope(TransactionScope && other) noexcept :
+	conn(std::exchange(other.conn, nullptr)), outer(other.outer)
+{
 }
 
 // It is acceptable for a commit to fail
 // NOLINTNEXTLINE(bugprone-exception-escape)
 DB::TransactionScope::~TransactionScope() noexcept
 {
+	if (!conn) {
+		// Moved from
+		return;
+	}
+	currentTransaction = outer;
 	try {
 		if (std::uncaught_exceptions()) {
 			conn->rollbackTx();
@@ -201,5 +339,11 @@ DB::TransactionScope::~TransactionScope() noexcept
 	}
 }
 
+DB::Connection *
+DB::TransactionScope::current()
+{
+	return currentTransaction;
+}
+
 INSTANTIATEFACTORY(DB::Connection, std::string)
 PLUGINRESOLVER(DB::ConnectionFactory, DB::Connection::resolvePlugin)
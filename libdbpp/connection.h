@@ -4,11 +4,13 @@
 #include "command_fwd.h"
 #include "error.h"
 #include <c++11Helpers.h>
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
 #include <exception.h>
 #include <factory.h> // IWYU pragma: keep
 #include <filesystem>
+#include <functional>
 #include <iosfwd>
 #include <memory>
 #include <optional>
@@ -16,6 +18,7 @@
 #include <string>
 #include <string_view>
 #include <sys/types.h>
+#include <type_traits>
 #include <typeinfo>
 #include <visibility.h>
 // IWYU pragma: no_include "factory.impl.h"
@@ -34,11 +37,33 @@ namespace DB {
 		UsingJoin = 2,
 	};
 
+	/// How a connection performs a table patch's updates and inserts in a single statement.
+	enum class BulkUpsertStyle {
+		/// Not supported; updates and inserts are always performed separately.
+		None,
+		/// INSERT INTO ... SELECT ... ON CONFLICT (pk) DO UPDATE, referring to the proposed row as EXCLUDED (as
+		/// in PostgreSQL). Requires a unique constraint on exactly the patch's primary key.
+		OnConflict,
+		/// MERGE INTO ... USING ... ON ... WHEN MATCHED AND ... THEN UPDATE WHEN NOT MATCHED THEN INSERT, as in
+		/// standard SQL.
+		Merge,
+	};
+
+	/// How a connection reports the rows affected by a data modifying statement.
+	enum class ReturningStyle {
+		/// Not supported; rows affected by a table patch can only be audited beforehand.
+		None,
+		/// A RETURNING clause on DELETE, UPDATE and INSERT, as in PostgreSQL.
+		Returning,
+	};
+
 	using TableName = std::string;
 	using ColumnName = std::string;
 	using ColumnNames = std::set<ColumnName>;
 	using PrimaryKey = ColumnNames;
 	using PKI = PrimaryKey::const_iterator;
+	/// Receiver of raw data chunks from a bulk download operation.
+	using BulkDownloadSink = std::function<void(const char *, size_t)>;
 
 	/// Result of a table patch operation.
 	struct PatchResult {
@@ -48,6 +73,19 @@ namespace DB {
 		unsigned int updates;
 		/// Number of rows inserted.
 		unsigned int inserts;
+		/// Number of rows updated or inserted by a single upsert (instead of being counted separately).
+		unsigned int upserts {0};
+
+		/// Accumulate the counts of another (partial) patch.
+		PatchResult &
+		operator+=(const PatchResult & other)
+		{
+			deletes += other.deletes;
+			updates += other.updates;
+			inserts += other.inserts;
+			upserts += other.upserts;
+			return *this;
+		}
 	};
 
 	/// Base class for database connectivity errors.
@@ -109,10 +147,54 @@ namespace DB {
 		virtual void releaseSavepoint(const std::string &);
 		/// Test server connection availability.
 		virtual void ping() const = 0;
+		/// Time of the last known successful interaction with the server.
+		[[nodiscard]] std::chrono::steady_clock::time_point lastActivity() const;
+		/// Record a successful interaction with the server. Connectors should call this from their commands.
+		void markActivity() const;
+		/// Record a failed interaction with the server; a pool closes the connection instead of reusing it.
+		/// Connectors should call this from their commands.
+		void markFailure() const;
+		/// Test whether any interaction with the server has been recorded as failed.
+		[[nodiscard]] bool hasFailed() const;
+		/// Perform an interaction with the server, recording its outcome. Success marks activity and a
+		/// ConnectionError marks a failure; other errors, such as a rejected statement, leave the connection
+		/// usable. Connectors should run their commands' execute and fetch through this.
+		template<typename Interaction>
+		decltype(auto)
+		interact(const Interaction & interaction) const
+		{
+			try {
+				if constexpr (std::is_void_v<std::invoke_result_t<const Interaction &>>) {
+					interaction();
+					markActivity();
+				}
+				else {
+					decltype(auto) result = interaction();
+					markActivity();
+					return result;
+				}
+			}
+			catch (const ConnectionError &) {
+				markFailure();
+				throw;
+			}
+		}
+		/// Time the connection was opened.
+		[[nodiscard]] std::chrono::steady_clock::time_point opened() const;
 		/// @cond
 		virtual BulkDeleteStyle bulkDeleteStyle() const = 0;
 		virtual BulkUpdateStyle bulkUpdateStyle() const = 0;
 		/// @endcond
+		/// The upsert statement this connection supports (default None). A connector reporting anything else must
+		/// execute that statement with a DO UPDATE/WHEN MATCHED condition and report the number of rows inserted
+		/// or actually updated as its affected row count, as TablePatch::upsert counts them in
+		/// PatchResult::upserts.
+		virtual BulkUpsertStyle bulkUpsertStyle() const;
+		/// How this connection reports the rows a statement affected (default None). A connector reporting
+		/// Returning must accept DELETE, UPDATE and INSERT statements ending in a RETURNING clause through
+		/// select(), executing the statement once and yielding one row per affected row, as table patches run
+		/// their after audits that way.
+		virtual ReturningStyle returningStyle() const;
 
 		/// Straight up execute a statement (no access to result set)
 		virtual void execute(const std::string & sql, const CommandOptionsCPtr & = nullptr);
@@ -138,6 +220,21 @@ namespace DB {
 		/// Load bulk data from a file (wrapper)
 		size_t bulkUploadData(FILE *) const;
 
+		/// Begin a bulk download operation.
+		/// @param source the source table or query.
+		/// @param opts database specific options to the unload command.
+		virtual void beginBulkDownload(const char * source, const char * opts);
+		/// Finish a bulk download operation.
+		virtual void endBulkDownload(const char *);
+		/// Stream all data for the current bulk download operation to the sink, returning the total size.
+		virtual size_t bulkDownloadData(const BulkDownloadSink &) const;
+		/// Download bulk data to a stream (wrapper)
+		size_t bulkDownloadData(std::ostream &) const;
+		/// Download bulk data to a file (wrapper)
+		size_t bulkDownloadData(FILE *) const;
+		/// Download bulk data to a file descriptor (wrapper)
+		size_t bulkDownloadData(int fd) const;
+
 		/// Return the Id used in the last insert
 		virtual int64_t insertId();
 
@@ -164,9 +261,14 @@ namespace DB {
 		virtual unsigned int patchUpdates(TablePatch * tp);
 		/// Internal perform table patch insert operations.
 		virtual unsigned int patchInserts(TablePatch * tp);
+		/// Internal perform table patch update and insert operations in one upsert.
+		virtual unsigned int patchUpserts(TablePatch * tp);
 
 	private:
 		unsigned int txOpenDepth {0};
+		std::chrono::steady_clock::time_point openedAt {std::chrono::steady_clock::now()};
+		mutable std::chrono::steady_clock::time_point activity {openedAt};
+		mutable bool failure {false};
 	};
 
 	/// Helper class for beginning/committing/rolling back transactions in accordance with scope and exceptions.
@@ -174,12 +276,21 @@ namespace DB {
 	public:
 		/// Create a new helper and associated transaction on the given connection.
 		explicit TransactionScope(Connection &);
+		/// Take over another scope's transaction, leaving the other to do nothing when destroyed. Scopes must still
+		/// end in the reverse order they were opened on the thread.
+		TransactionScope(TransactionScope &&) noexcept;
 		~TransactionScope() noexcept;
 		/// Standard special members
-		SPECIAL_MEMBERS_DEFAULT_MOVE_NO_COPY(TransactionScope);
+		SPECIAL_MEMBERS_COPY(TransactionScope, delete);
+		/// Standard special members
+		TransactionScope & operator=(TransactionScope &&) = delete;
+
+		/// The connection of the innermost TransactionScope on the calling thread, if any.
+		[[nodiscard]] static Connection * current();
 
 	private:
 		Connection * conn;
+		Connection * outer;
 	};
 
 	using ConnectionFactory = AdHoc::Factory<Connection, std::string>;
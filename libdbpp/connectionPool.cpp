@@ -1,34 +1,987 @@
 #include "connectionPool.h"
+#include "command.h"
+#include "modifycommand.h"
+#include "selectcommand.h"
+#include <algorithm>
+#include <atomic>
+#include <exception>
 #include <factory.h>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <future>
+#include <map>
 #include <resourcePool.impl.h>
+#include <stdexcept>
+#include <thread>
 #include <utility>
 
 template class AdHoc::ResourcePool<DB::Connection>;
 template class AdHoc::ResourceHandle<DB::Connection>;
 
 namespace DB {
-	BasicConnectionPool::BasicConnectionPool(unsigned int m, unsigned int k) : ResourcePool<Connection>(m, k) { }
+	struct BasicConnectionPool::Slot {
+		// Held while inspecting or changing the slot, never while the connection is in use
+		std::atomic_flag busy;
+		std::optional<ConnectionHandle> handle;
+		// The handle count when only the pool references the connection
+		unsigned int idleCount {0};
+		// The thread which last claimed the connection
+		std::atomic<std::thread::id> owner;
+	};
 
-	ConnectionPool::ConnectionPool(unsigned int m, unsigned int k, const std::string & t, std::string cs) :
-		BasicConnectionPool(m, k), factory(ConnectionFactory::get(t)), connectionString(std::move(cs))
+	struct PendingConnection::Request {
+		enum class State { Queued, Serving, Abandoned, Cancelled };
+
+		// Only for getAsync requests, which the pool's dispatch thread serves
+		std::optional<std::promise<ConnectionHandle>> promise;
+		std::optional<std::chrono::steady_clock::time_point> deadline;
+		std::chrono::steady_clock::time_point start;
+		std::atomic<State> state {State::Queued};
+	};
+
+	struct BasicConnectionPool::PreparedCommands {
+		// Every connection is adopted by createConnection, so is forgotten here before it closes and another can
+		// take its address
+		using Key = std::pair<Connection const *, std::size_t>;
+
+		bool
+		has(Connection const * c, std::size_t hash)
+		{
+			std::lock_guard<std::mutex> l(lock);
+			return selects.contains({c, hash}) || modifies.contains({c, hash});
+		}
+
+		template<typename Command, typename Prepare>
+		std::shared_ptr<Command>
+		get(std::map<Key, std::shared_ptr<Command>> & commands, Connection const * c, std::size_t hash,
+				const std::string & sql, const Prepare & prepare)
+		{
+			bool busy = false;
+			{
+				std::lock_guard<std::mutex> l(lock);
+				// Check for a hash collision too
+				if (auto i = commands.find({c, hash}); i != commands.end() && i->second->sql == sql) {
+					if (i->second.use_count() == 1) {
+						return i->second;
+					}
+					// Held by a caller further up this connection's transaction, who may still be using it
+					busy = true;
+				}
+			}
+			auto command = prepare();
+			if (!busy) {
+				std::lock_guard<std::mutex> l(lock);
+				commands.insert_or_assign({c, hash}, command);
+			}
+			return command;
+		}
+
+		void
+		forget(Connection const * c)
+		{
+			std::vector<std::shared_ptr<void>> released;
+			{
+				std::lock_guard<std::mutex> l(lock);
+				const auto extract = [c, &released](auto & commands) {
+					const auto end = commands.upper_bound({c, std::numeric_limits<std::size_t>::max()});
+					for (auto i = commands.lower_bound({c, 0}); i != end;) {
+						released.push_back(std::move(i->second));
+						i = commands.erase(i);
+					}
+				};
+				extract(selects);
+				extract(modifies);
+			}
+			// Released outside the lock, whilst the connection is still open
+		}
+
+		std::mutex lock;
+		std::map<Key, SelectCommandPtr> selects;
+		std::map<Key, ModifyCommandPtr> modifies;
+	};
+
+	// Slotted connections are released without the pool knowing, so waiting threads look at the slots again
+	// at least this often as well as whenever a connection is returned to the shared pool
+	static constexpr std::chrono::milliseconds AFFINITY_RECHECK {5};
+	// Longest the dispatch thread waits for a connection before checking its request is still wanted
+	static constexpr std::chrono::milliseconds DISPATCH_RECHECK {10};
+	// Set on threads opening connections for warm, which mustn't take each other's
+	static thread_local bool warming = false;
+	// Set on threads inspecting idle connections, which mustn't look active as a result
+	static thread_local bool maintaining = false;
+
+	// Fixed per connection, spread evenly over [0, 1)
+	static double
+	staggerOf(Connection const * c)
+	{
+		const uint64_t h = std::hash<Connection const *> {}(c) * 0x9E3779B97F4A7C15ULL;
+		return static_cast<double>(h >> 11U) / static_cast<double>(1ULL << 53U);
+	}
+
+	void
+	rollbackEach(std::vector<ConnectionHandle>::iterator begin, std::vector<ConnectionHandle>::iterator end) noexcept
+	{
+		std::for_each(begin, end, [](auto & c) {
+			try {
+				c->rollbackTx();
+			}
+			catch (...) {
+				// Best effort, the handle is discarded anyway
+			}
+		});
+	}
+
+	BasicConnectionPool::BasicConnectionPool(unsigned int m, unsigned int k, ConnectionPoolMode mode) :
+		ResourcePool<Connection>(m, k), keepOpen(k),
+		slots(mode == ConnectionPoolMode::ThreadAffinity ? std::min(m, k) : 0),
+		preparedCommands(std::make_shared<PreparedCommands>())
+	{
+	}
+
+	BasicConnectionPool::~BasicConnectionPool()
+	{
+		{
+			std::lock_guard<std::mutex> l(waitersLock);
+			dispatchStopping = true;
+		}
+		waitersChanged.notify_all();
+		if (dispatcher.joinable()) {
+			dispatcher.join();
+		}
+		// Return slotted connections while the retiring set still exists
+		slots.clear();
+	}
+
+	ConnectionPool::ConnectionPool(
+			unsigned int m, unsigned int k, const std::string & t, std::string cs, ConnectionPoolMode mode) :
+		BasicConnectionPool(m, k, mode),
+		factory(ConnectionFactory::get(t)), connectionString(std::move(cs))
 	{
 	}
 
 	ConnectionPtr
 	ConnectionPool::createResource() const
+	{
+		return createConnection([this]() {
+			return connect();
+		});
+	}
+
+	ConnectionPtr
+	ConnectionPool::connect() const
 	{
 		return factory->create(connectionString);
 	}
 
+	ConnectionPtr
+	BasicConnectionPool::createConnection(const std::function<ConnectionPtr()> & open) const
+	{
+		if (maintaining) {
+			// Inspecting idle connections only, as if none were available in time
+			throw AdHoc::TimeOutOnResourcePoolT<Connection>();
+		}
+		if (auto c = takeWarmed()) {
+			return c;
+		}
+		const auto start = std::chrono::steady_clock::now();
+		auto c = open();
+		createTime.record(std::chrono::steady_clock::now() - start);
+		return adopt(std::move(c));
+	}
+
+	ConnectionHandle
+	BasicConnectionPool::get()
+	{
+		return acquire({});
+	}
+
+	ConnectionHandle
+	BasicConnectionPool::get(unsigned int timeout)
+	{
+		return acquire(std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout));
+	}
+
+	ConnectionHandle
+	BasicConnectionPool::get(std::chrono::steady_clock::time_point deadline)
+	{
+		return acquire(deadline);
+	}
+
+	PendingConnection::PendingConnection(ConnectionHandle h)
+	{
+		std::promise<ConnectionHandle> ready;
+		ready.set_value(std::move(h));
+		future = ready.get_future();
+	}
+
+	PendingConnection::PendingConnection(std::future<ConnectionHandle> f, std::shared_ptr<Request> r) :
+		future(std::move(f)), request(std::move(r))
+	{
+	}
+
+	PendingConnection::~PendingConnection()
+	{
+		if (!request) {
+			return;
+		}
+		// Still queued, the dispatch thread drops it
+		auto queued = Request::State::Queued;
+		if (request->state.compare_exchange_strong(queued, Request::State::Cancelled)) {
+			return;
+		}
+		// Being served, the dispatch thread gives up shortly; wait so it's done with the pool before the caller is
+		auto serving = Request::State::Serving;
+		if (request->state.compare_exchange_strong(serving, Request::State::Abandoned) && future.valid()) {
+			future.wait();
+		}
+	}
+
+	ConnectionHandle
+	PendingConnection::get()
+	{
+		return future.get();
+	}
+
+	PendingConnection
+	BasicConnectionPool::getAsync(std::optional<std::chrono::steady_clock::time_point> deadline)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		if (auto h = inCurrentTransaction()) {
+			return PendingConnection(std::move(*h));
+		}
+		if (auto h = claimIdleUnqueued({})) {
+			return PendingConnection(checkedOutSince(std::move(*h), start));
+		}
+		auto request = std::make_shared<PendingConnection::Request>();
+		request->promise.emplace();
+		request->deadline = deadline;
+		request->start = start;
+		auto ready = request->promise->get_future();
+		{
+			std::lock_guard<std::mutex> l(waitersLock);
+			if (!dispatcher.joinable()) {
+				dispatcher = std::thread(&BasicConnectionPool::dispatch, this);
+			}
+		}
+		// Join the queue now, so the caller's place is kept
+		enqueue(request);
+		return {std::move(ready), std::move(request)};
+	}
+
+	ConnectionHandle
+	BasicConnectionPool::acquire(const std::optional<std::chrono::steady_clock::time_point> & deadline,
+			std::optional<std::size_t> withCommand)
+	{
+		if (auto h = inCurrentTransaction()) {
+			return std::move(*h);
+		}
+		const auto start = std::chrono::steady_clock::now();
+		if (auto h = claimIdleUnqueued(withCommand)) {
+			return checkedOutSince(std::move(*h), start);
+		}
+		return checkedOutSince(queued(enqueue(std::make_shared<PendingConnection::Request>()), deadline), start);
+	}
+
+	std::optional<ConnectionHandle>
+	BasicConnectionPool::claimIdleUnqueued(std::optional<std::size_t> withCommand)
+	{
+		// Lock free, but only when nobody is queued ahead
+		if (waiting.load(std::memory_order_acquire)) {
+			return {};
+		}
+		if (slots.empty()) {
+			// No queue to keep order in, so skip it when a connection is free
+			if (freeCount() > 0) {
+				try {
+					return ResourcePool<Connection>::get(0);
+				}
+				catch (const AdHoc::TimeOutOnResourcePool &) {
+					// Taken by another thread
+				}
+			}
+			return {};
+		}
+		// Prefer a connection with the command, then any
+		if (withCommand) {
+			if (auto h = claimAnyIdle(withCommand)) {
+				return h;
+			}
+		}
+		return claimAnyIdle({});
+	}
+
+	std::optional<ConnectionHandle>
+	BasicConnectionPool::claimAnyIdle(std::optional<std::size_t> withCommand) const
+	{
+		const auto me = std::this_thread::get_id();
+		for (auto & slot : slots) {
+			if (slot.owner.load(std::memory_order_relaxed) == me) {
+				if (auto h = claimIdle(slot, withCommand)) {
+					return h;
+				}
+			}
+		}
+		const auto first = nextSlot.fetch_add(1, std::memory_order_relaxed);
+		for (std::size_t n = 0; n < slots.size(); n++) {
+			if (auto h = claimIdle(slots[(first + n) % slots.size()], withCommand)) {
+				return h;
+			}
+		}
+		return {};
+	}
+
+	std::optional<ConnectionHandle>
+	BasicConnectionPool::inCurrentTransaction()
+	{
+		auto * const c = TransactionScope::current();
+		if (!c) {
+			return {};
+		}
+		for (auto & slot : slots) {
+			// Only held briefly, and this connection can't be claimed while the caller has it
+			while (slot.busy.test_and_set(std::memory_order_acquire)) {
+				std::this_thread::yield();
+			}
+			std::optional<ConnectionHandle> h;
+			if (slot.handle && slot.handle->get() == c) {
+				h = *slot.handle;
+			}
+			slot.busy.clear(std::memory_order_release);
+			if (h) {
+				return h;
+			}
+		}
+		// Checked out of the shared pool, by this thread or for it by getAsync; lent without another checkout
+		std::lock_guard<std::mutex> l(checkedOutLock);
+		if (auto co = checkedOut.find(c); co != checkedOut.end() && !co->second.connection.expired()) {
+			auto & lent = co->second.lent;
+			if (!lent.front()) {
+				// Doesn't keep the connection open, that's the checkout's job
+				lent.fill(std::make_shared<ConnectionHandle::Object>(ConnectionPtr(ConnectionPtr {}, c), this));
+			}
+			return ConnectionHandle(lent.front());
+		}
+		return {};
+	}
+
+	BasicConnectionPool::Waiters::iterator
+	BasicConnectionPool::enqueue(std::shared_ptr<PendingConnection::Request> request)
+	{
+		const bool async = request->promise.has_value();
+		Waiters::iterator place;
+		{
+			std::lock_guard<std::mutex> l(waitersLock);
+			waiting.fetch_add(1, std::memory_order_release);
+			place = waiters.insert(waiters.end(), std::move(request));
+		}
+		if (async) {
+			// Wake the dispatch thread
+			waitersChanged.notify_all();
+		}
+		return place;
+	}
+
+	void
+	BasicConnectionPool::leave(Waiters::iterator place)
+	{
+		{
+			std::lock_guard<std::mutex> l(waitersLock);
+			waiters.erase(place);
+			waiting.fetch_sub(1, std::memory_order_release);
+		}
+		waitersChanged.notify_all();
+	}
+
+	ConnectionHandle
+	BasicConnectionPool::queued(
+			Waiters::iterator place, const std::optional<std::chrono::steady_clock::time_point> & deadline)
+	{
+		try {
+			{
+				std::unique_lock<std::mutex> l(waitersLock);
+				const auto atFront = [this, place]() {
+					return waiters.begin() == place;
+				};
+				if (!deadline) {
+					waitersChanged.wait(l, atFront);
+				}
+				else if (!waitersChanged.wait_until(l, *deadline, atFront)) {
+					throw AdHoc::TimeOutOnResourcePoolT<Connection>();
+				}
+			}
+			auto h = checkout(deadline);
+			leave(place);
+			return h;
+		}
+		catch (const AdHoc::TimeOutOnResourcePool &) {
+			timeouts.fetch_add(1, std::memory_order_relaxed);
+			leave(place);
+			throw;
+		}
+		catch (...) {
+			leave(place);
+			throw;
+		}
+	}
+
+	std::optional<std::chrono::steady_clock::time_point>
+	BasicConnectionPool::sweep()
+	{
+		using State = PendingConnection::Request::State;
+		const auto now = std::chrono::steady_clock::now();
+		std::optional<std::chrono::steady_clock::time_point> next;
+		bool dropped = false;
+		// Drop cancelled requests and fail those out of time, wherever they are in the queue
+		for (auto w = waiters.begin(); w != waiters.end();) {
+			auto & request = **w;
+			const auto state = request.state.load();
+			if (!request.promise || state == State::Serving || state == State::Abandoned) {
+				++w;
+				continue;
+			}
+			if (state == State::Cancelled) {
+				// Nobody to tell
+			}
+			else if (request.deadline && *request.deadline <= now) {
+				timeouts.fetch_add(1, std::memory_order_relaxed);
+				request.promise->set_exception(std::make_exception_ptr(AdHoc::TimeOutOnResourcePoolT<Connection>()));
+			}
+			else {
+				if (request.deadline) {
+					next = next ? std::min(*next, *request.deadline) : *request.deadline;
+				}
+				++w;
+				continue;
+			}
+			w = waiters.erase(w);
+			waiting.fetch_sub(1, std::memory_order_release);
+			dropped = true;
+		}
+		if (dropped) {
+			waitersChanged.notify_all();
+		}
+		return next;
+	}
+
+	void
+	BasicConnectionPool::dispatch()
+	{
+		using State = PendingConnection::Request::State;
+		std::unique_lock<std::mutex> l(waitersLock);
+		while (!dispatchStopping) {
+			const auto wake = sweep();
+			if (!waiters.empty() && waiters.front()->promise) {
+				auto queued = State::Queued;
+				// Otherwise cancelled, and dropped next time round
+				if (waiters.front()->state.compare_exchange_strong(queued, State::Serving)) {
+					const auto place = waiters.begin();
+					l.unlock();
+					serve(place);
+					l.lock();
+				}
+				continue;
+			}
+			if (wake) {
+				waitersChanged.wait_until(l, *wake);
+			}
+			else {
+				waitersChanged.wait(l);
+			}
+		}
+	}
+
+	void
+	BasicConnectionPool::serve(Waiters::iterator place)
+	{
+		auto & request = **place;
+		try {
+			for (;;) {
+				const auto recheck = std::chrono::steady_clock::now() + DISPATCH_RECHECK;
+				try {
+					auto h = checkout(request.deadline ? std::min(*request.deadline, recheck) : recheck);
+					request.promise->set_value(checkedOutSince(std::move(h), request.start));
+					break;
+				}
+				catch (const AdHoc::TimeOutOnResourcePool &) {
+					if (request.deadline && std::chrono::steady_clock::now() >= *request.deadline) {
+						timeouts.fetch_add(1, std::memory_order_relaxed);
+						throw;
+					}
+					std::lock_guard<std::mutex> l(waitersLock);
+					if (dispatchStopping || request.state == PendingConnection::Request::State::Abandoned) {
+						throw;
+					}
+					// Others queued behind may be out of time meanwhile
+					sweep();
+				}
+			}
+		}
+		catch (...) {
+			request.promise->set_exception(std::current_exception());
+		}
+		leave(place);
+	}
+
+	ConnectionHandle
+	BasicConnectionPool::checkedOutSince(ConnectionHandle h, std::chrono::steady_clock::time_point start)
+	{
+		const auto now = std::chrono::steady_clock::now();
+		checkoutWait.record(now - start);
+		checkouts.fetch_add(1, std::memory_order_relaxed);
+		if (slots.empty()) {
+			std::lock_guard<std::mutex> l(checkedOutLock);
+			checkedOut[h.get()] = {now, h.handle(), {}};
+		}
+		return h;
+	}
+
+	ConnectionHandle
+	BasicConnectionPool::checkout(const std::optional<std::chrono::steady_clock::time_point> & deadline)
+	{
+		const auto remaining = [&deadline]() {
+			const auto left
+					= std::chrono::ceil<std::chrono::milliseconds>(*deadline - std::chrono::steady_clock::now());
+			return static_cast<unsigned int>(std::max<std::chrono::milliseconds::rep>(0, left.count()));
+		};
+		if (slots.empty()) {
+			return deadline ? ResourcePool<Connection>::get(remaining()) : ResourcePool<Connection>::get();
+		}
+		for (;;) {
+			const auto seen = [this]() {
+				std::lock_guard<std::mutex> l(releasesLock);
+				return releases;
+			}();
+			if (auto h = claimAnyIdle({})) {
+				return std::move(*h);
+			}
+			if (freeCount() > 0) {
+				try {
+					auto h = ResourcePool<Connection>::get(0);
+					for (auto & slot : slots) {
+						if (store(slot, h)) {
+							break;
+						}
+					}
+					return h;
+				}
+				catch (const AdHoc::TimeOutOnResourcePool &) {
+					// Taken by another thread
+				}
+			}
+			std::unique_lock<std::mutex> l(releasesLock);
+			const auto recheck = std::chrono::steady_clock::now() + AFFINITY_RECHECK;
+			if (!releasesChanged.wait_until(l, deadline ? std::min(*deadline, recheck) : recheck,
+						[this, seen]() {
+							return releases != seen;
+						})
+					&& deadline && std::chrono::steady_clock::now() >= *deadline) {
+				throw AdHoc::TimeOutOnResourcePoolT<Connection>();
+			}
+		}
+	}
+
+	std::optional<ConnectionHandle>
+	BasicConnectionPool::claimIdle(Slot & slot, std::optional<std::size_t> withCommand) const
+	{
+		if (slot.busy.test_and_set(std::memory_order_acquire)) {
+			return {};
+		}
+		std::optional<ConnectionHandle> claimed;
+		if (slot.handle && slot.handle->handleCount() == slot.idleCount
+				&& (!withCommand || preparedCommands->has(slot.handle->get(), *withCommand))) {
+			// Pair with the release of the previous user's handle
+			std::atomic_thread_fence(std::memory_order_acquire);
+			try {
+				// Slotted connections aren't returned to the pool between uses, so check them as if they were
+				if (slot.handle->get()->hasFailed()) {
+					throw ConnectionError();
+				}
+				if (slot.handle->get()->inTx()) {
+					throw TransactionStillOpen();
+				}
+				testResource(slot.handle->get());
+				claimed = *slot.handle;
+				slot.owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+			}
+			catch (...) {
+				retire(slot.handle->get());
+				slot.handle.reset();
+			}
+		}
+		slot.busy.clear(std::memory_order_release);
+		return claimed;
+	}
+
+	bool
+	BasicConnectionPool::store(Slot & slot, const ConnectionHandle & h) const
+	{
+		if (slot.busy.test_and_set(std::memory_order_acquire)) {
+			return false;
+		}
+		const bool empty = !slot.handle;
+		if (empty) {
+			slot.handle = h;
+			// Excluding the caller's handle
+			slot.idleCount = h.handleCount() - 1;
+			slot.owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+		}
+		slot.busy.clear(std::memory_order_release);
+		return empty;
+	}
+
+	unsigned int
+	BasicConnectionPool::idleSlotted() const
+	{
+		unsigned int idle = 0;
+		for (auto & slot : slots) {
+			// Only held briefly
+			while (slot.busy.test_and_set(std::memory_order_acquire)) {
+				std::this_thread::yield();
+			}
+			if (slot.handle && slot.handle->handleCount() == slot.idleCount) {
+				idle += 1;
+			}
+			slot.busy.clear(std::memory_order_release);
+		}
+		return idle;
+	}
+
+	void
+	BasicConnectionPool::announceRelease() const
+	{
+		if (slots.empty()) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> l(releasesLock);
+			releases += 1;
+		}
+		releasesChanged.notify_all();
+	}
+
+	unsigned int
+	BasicConnectionPool::inUseCount() const
+	{
+		const auto idle = idleSlotted();
+		// Idle slotted connections are always checked out of the shared pool
+		return std::max(ResourcePool<Connection>::inUseCount(), idle) - idle;
+	}
+
+	unsigned int
+	BasicConnectionPool::availableCount() const
+	{
+		return ResourcePool<Connection>::availableCount() + idleSlotted();
+	}
+
+	void
+	BasicConnectionPool::retire(Connection const * c) const
+	{
+		std::lock_guard<std::mutex> l(retiringLock);
+		retiring.insert(c);
+	}
+
 	void
 	BasicConnectionPool::returnTestResource(Connection const * c) const
 	{
+		// Kept or closed, either way there's room for a waiting thread
+		announceRelease();
+		{
+			std::lock_guard<std::mutex> l(checkedOutLock);
+			if (auto co = checkedOut.find(c); co != checkedOut.end()) {
+				holdTime.record(std::chrono::steady_clock::now() - co->second.since);
+				checkedOut.erase(co);
+			}
+		}
+		{
+			std::lock_guard<std::mutex> l(retiringLock);
+			if (retiring.erase(c)) {
+				throw ConnectionError();
+			}
+		}
+		if (c->hasFailed()) {
+			throw ConnectionError();
+		}
 		c->finish();
+		if (!maintaining) {
+			c->markActivity();
+		}
 	}
 
 	void
 	BasicConnectionPool::testResource(Connection const * c) const
 	{
-		c->ping();
+		if (maintaining) {
+			return;
+		}
+		if (pingAfterIdle.count() > 0 && std::chrono::steady_clock::now() - c->lastActivity() < pingAfterIdle) {
+			return;
+		}
+		const auto start = std::chrono::steady_clock::now();
+		try {
+			c->ping();
+		}
+		catch (...) {
+			pingFailures.fetch_add(1, std::memory_order_relaxed);
+			pingTime.record(std::chrono::steady_clock::now() - start);
+			throw;
+		}
+		const auto taken = std::chrono::steady_clock::now() - start;
+		pingTime.record(taken);
+		c->markActivity();
+		pinged(taken);
+	}
+
+	void
+	BasicConnectionPool::pinged(std::chrono::steady_clock::duration) const
+	{
+	}
+
+	std::chrono::steady_clock::duration
+	BasicConnectionPool::warm(unsigned int n, unsigned int parallelism)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		const auto open = availableCount() + inUseCount() + [this]() {
+			std::lock_guard<std::mutex> l(warmedLock);
+			return static_cast<unsigned int>(warmed.size());
+		}();
+		const auto needed = std::min(n, keepOpen) > open ? std::min(n, keepOpen) - open : 0U;
+		std::atomic<unsigned int> next {0};
+		std::exception_ptr failure;
+		std::mutex failureLock;
+		auto opener = [&]() {
+			warming = true;
+			try {
+				while (next++ < needed) {
+					auto c = createResource();
+					std::lock_guard<std::mutex> l(warmedLock);
+					warmed.push_back(std::move(c));
+				}
+			}
+			catch (...) {
+				next = needed;
+				std::lock_guard<std::mutex> l(failureLock);
+				if (!failure) {
+					failure = std::current_exception();
+				}
+			}
+			warming = false;
+		};
+		std::vector<std::thread> openers;
+		for (unsigned int t = 1; t < std::clamp(parallelism, 1U, std::max(needed, 1U)); t++) {
+			openers.emplace_back(opener);
+		}
+		opener();
+		for (auto & t : openers) {
+			t.join();
+		}
+		// Check out until the pool has taken every warmed connection, they're kept on return. These aren't checkouts
+		// for the metrics, and never wait for or jump ahead of queued callers; whatever isn't taken here is taken by
+		// createResource when next needed.
+		std::vector<ConnectionHandle> handles;
+		while (!waiting.load(std::memory_order_acquire) && freeCount() > 0) {
+			{
+				std::lock_guard<std::mutex> l(warmedLock);
+				if (warmed.empty()) {
+					break;
+				}
+			}
+			try {
+				handles.push_back(ResourcePool<Connection>::get(0));
+			}
+			catch (const AdHoc::TimeOutOnResourcePool &) {
+				break;
+			}
+		}
+		handles.clear();
+		if (failure) {
+			std::rethrow_exception(failure);
+		}
+		return std::chrono::steady_clock::now() - start;
+	}
+
+	ConnectionPtr
+	BasicConnectionPool::takeWarmed() const
+	{
+		if (warming) {
+			return {};
+		}
+		std::lock_guard<std::mutex> l(warmedLock);
+		if (warmed.empty()) {
+			return {};
+		}
+		auto c = std::move(warmed.back());
+		warmed.pop_back();
+		return c;
+	}
+
+	ConnectionPoolMetrics
+	BasicConnectionPool::metrics() const
+	{
+		ConnectionPoolMetrics m;
+		m.checkouts = checkouts.load(std::memory_order_relaxed);
+		m.timeouts = timeouts.load(std::memory_order_relaxed);
+		m.pingFailures = pingFailures.load(std::memory_order_relaxed);
+		m.inUse = inUseCount();
+		m.available = availableCount();
+		m.checkoutWait = checkoutWait.snapshot();
+		m.hold = holdTime.snapshot();
+		m.create = createTime.snapshot();
+		m.ping = pingTime.snapshot();
+		m.creates = m.create.count;
+		m.destroys = m.creates - std::min<uint64_t>(m.creates, m.inUse + m.available);
+		return m;
+	}
+
+	void
+	BasicConnectionPool::maintain(const ConnectionPoolMaintenance & settings)
+	{
+		const auto now = std::chrono::steady_clock::now();
+		const auto expired = [&settings, now](Connection const * c) {
+			if (settings.maxIdle.count() > 0 && now - c->lastActivity() > settings.maxIdle) {
+				return true;
+			}
+			if (settings.maxLifetime.count() > 0) {
+				const auto jittered = std::chrono::duration<double>(settings.maxLifetime)
+						* (1 - settings.lifetimeJitter * staggerOf(c));
+				const auto lifetime = std::chrono::duration_cast<std::chrono::steady_clock::duration>(jittered);
+				return now - c->opened() > lifetime;
+			}
+			return false;
+		};
+		{
+			std::lock_guard<std::mutex> l(warmedLock);
+			std::erase_if(warmed, [&expired](const auto & c) {
+				return expired(c.get());
+			});
+		}
+		for (auto & slot : slots) {
+			if (slot.busy.test_and_set(std::memory_order_acquire)) {
+				continue;
+			}
+			if (slot.handle && slot.handle->handleCount() == slot.idleCount) {
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (slot.handle->get()->hasFailed() || expired(slot.handle->get())) {
+					retire(slot.handle->get());
+					// Returned to the shared pool, which announces it
+					slot.handle.reset();
+				}
+			}
+			slot.busy.clear(std::memory_order_release);
+		}
+		maintaining = true;
+		try {
+			// Each is returned to the back of the available list, so this visits each once
+			for (auto n = ResourcePool<Connection>::availableCount();
+					n > 0 && ResourcePool<Connection>::availableCount() > 0; n--) {
+				auto h = ResourcePool<Connection>::get(0);
+				if (expired(h.get())) {
+					retire(h.get());
+				}
+			}
+		}
+		catch (const AdHoc::TimeOutOnResourcePool &) {
+			// Pool is busy or none were left idle, nothing to reap
+		}
+		catch (...) {
+			maintaining = false;
+			throw;
+		}
+		maintaining = false;
+		if (settings.minOpen > 0) {
+			warm(settings.minOpen, settings.minOpen);
+		}
+	}
+
+	// Before the thread starts, which would otherwise spin without waiting
+	static ConnectionPoolMaintenance
+	checkInterval(ConnectionPoolMaintenance s)
+	{
+		if (s.interval.count() <= 0) {
+			throw std::invalid_argument("Pool maintenance interval must be positive");
+		}
+		return s;
+	}
+
+	ConnectionPoolMaintainer::ConnectionPoolMaintainer(BasicConnectionPool & p, ConnectionPoolMaintenance s) :
+		pool(p), settings(checkInterval(std::move(s))), maintenance(&ConnectionPoolMaintainer::run, this)
+	{
+	}
+
+	ConnectionPoolMaintainer::~ConnectionPoolMaintainer()
+	{
+		{
+			std::lock_guard<std::mutex> l(stateLock);
+			stopping = true;
+		}
+		wake.notify_all();
+		maintenance.join();
+	}
+
+	void
+	ConnectionPoolMaintainer::run()
+	{
+		std::unique_lock<std::mutex> l(stateLock);
+		while (!wake.wait_for(l, settings.interval, [this]() {
+			return stopping;
+		})) {
+			l.unlock();
+			try {
+				pool.maintain(settings);
+			}
+			catch (...) {
+				// Try again next time
+			}
+			l.lock();
+		}
+	}
+
+	ConnectionPtr
+	BasicConnectionPool::adopt(ConnectionPtr c) const
+	{
+		if (!initScript.empty()) {
+			std::ifstream f(initScript);
+			if (!f.good()) {
+				throw std::fstream::failure("Failed to open init script: " + initScript.string());
+			}
+			c->executeScript(f, initScript.parent_path());
+		}
+		auto * raw = c.get();
+		return {raw, [c = std::move(c), commands = preparedCommands](Connection * r) mutable {
+					commands->forget(r);
+					c.reset();
+				}};
+	}
+
+	static std::pair<std::size_t, CommandOptionsCPtr>
+	commandKey(const std::string & sql, const CommandOptionsCPtr & opts)
+	{
+		if (opts && opts->hash) {
+			return {*opts->hash, opts};
+		}
+		const auto hash = std::hash<std::string> {}(sql);
+		return {hash, opts ? opts : std::make_shared<CommandOptions>(hash)};
+	}
+
+	PooledCommand<SelectCommand>
+	BasicConnectionPool::getSelect(const std::string & sql, const CommandOptionsCPtr & opts)
+	{
+		const auto [hash, options] = commandKey(sql, opts);
+		auto h = acquire({}, hash);
+		auto command = preparedCommands->get(preparedCommands->selects, h.get(), hash, sql, [&h, &sql, &options]() {
+			return h->select(sql, options);
+		});
+		return {std::move(h), std::move(command)};
+	}
+
+	PooledCommand<ModifyCommand>
+	BasicConnectionPool::getModify(const std::string & sql, const CommandOptionsCPtr & opts)
+	{
+		const auto [hash, options] = commandKey(sql, opts);
+		auto h = acquire({}, hash);
+		auto command = preparedCommands->get(preparedCommands->modifies, h.get(), hash, sql, [&h, &sql, &options]() {
+			return h->modify(sql, options);
+		});
+		return {std::move(h), std::move(command)};
 	}
 }
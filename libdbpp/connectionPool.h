@@ -3,26 +3,260 @@
 
 #include "connection.h"
 #include "connection_fwd.h" // for ConnectionPtr
+#include "poolMetrics.h"
 #include "resourcePool.impl.h" // for ResourcePool<>::InUse, ResourcePool
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <list>
 #include <map> // for operator!=
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 #include <visibility.h>
 
 namespace DB {
+	/// Handle to a connection checked out of a pool.
+	using ConnectionHandle = AdHoc::ResourceHandle<Connection>;
+
+	/// @cond
+	// Roll back each connection's transaction, ignoring failures; for handles about to be discarded anyway
+	DLL_PRIVATE void rollbackEach(
+			std::vector<ConnectionHandle>::iterator begin, std::vector<ConnectionHandle>::iterator end) noexcept;
+	/// @endcond
+
+	/// How a connection pool hands out connections.
+	enum class ConnectionPoolMode {
+		/// All checkouts go through the shared pool.
+		Shared,
+		/// Up to keep connections are cached in slots with an affinity to the thread that last used them.
+		/// Idle slots are claimed without taking the shared pool's lock and released simply by dropping
+		/// the handle; threads prefer the connection they last used, then any other idle slot, before
+		/// falling back to the shared pool.
+		ThreadAffinity,
+	};
+
+	/// Settings for a connection pool's background maintenance.
+	struct ConnectionPoolMaintenance {
+		/// Time between maintenance passes.
+		std::chrono::milliseconds interval {1000};
+		/// Close connections idle for longer than this (zero never does).
+		std::chrono::milliseconds maxIdle {0};
+		/// Replace connections open for longer than this (zero never does).
+		std::chrono::milliseconds maxLifetime {0};
+		/// Fraction by which each connection's lifetime is shortened, varying per connection so they don't all
+		/// expire together.
+		double lifetimeJitter {0.1};
+		/// Number of connections to keep open (capped at keep), opened in the background as needed.
+		unsigned int minOpen {0};
+	};
+
+	/// A connection checked out of a pool along with a command prepared on it.
+	template<typename Command> struct PooledCommand {
+		/// The connection, which must be held for as long as the command is used.
+		ConnectionHandle connection;
+		/// The command, shared with later users of the same connection.
+		std::shared_ptr<Command> command;
+	};
+
+	/// A connection requested from a pool without blocking (see BasicConnectionPool::getAsync).
+	/// Destroying it before the connection is taken cancels the request.
+	class DLL_PUBLIC PendingConnection {
+	public:
+		~PendingConnection();
+		/// Standard special members
+		PendingConnection(PendingConnection &&) noexcept = default;
+		/// Standard special members
+		PendingConnection(const PendingConnection &) = delete;
+		/// Standard special members
+		PendingConnection & operator=(const PendingConnection &) = delete;
+		/// Standard special members
+		PendingConnection & operator=(PendingConnection &&) = delete;
+
+		/// Wait for the connection and take it (once only).
+		/// @throws AdHoc::TimeOutOnResourcePool if the request's deadline passed first.
+		ConnectionHandle get();
+		/// Wait at most timeout for the connection, as std::future::wait_for.
+		template<typename Rep, typename Period>
+		std::future_status
+		wait_for(const std::chrono::duration<Rep, Period> & timeout) const
+		{
+			return future.wait_for(timeout);
+		}
+
+	private:
+		friend class BasicConnectionPool;
+		struct Request;
+
+		explicit PendingConnection(ConnectionHandle);
+		PendingConnection(std::future<ConnectionHandle>, std::shared_ptr<Request>);
+
+		std::future<ConnectionHandle> future;
+		std::shared_ptr<Request> request;
+	};
+
 	/// Specialisation of AdHoc::ResourcePool for database connections.
 	class DLL_PUBLIC BasicConnectionPool : public AdHoc::ResourcePool<Connection> {
 	public:
 		/// Create a new connection pool.
 		/// @param max Maximum number of concurrent database connections.
 		/// @param keep Number of connections to keep open after use.
-		BasicConnectionPool(unsigned int max, unsigned int keep);
+		/// @param mode How connections are handed out.
+		BasicConnectionPool(unsigned int max, unsigned int keep, ConnectionPoolMode mode = ConnectionPoolMode::Shared);
+		~BasicConnectionPool() override;
+		/// Standard special members
+		SPECIAL_MEMBERS_COPY(BasicConnectionPool, delete);
+		/// Standard special members
+		SPECIAL_MEMBERS_MOVE(BasicConnectionPool, delete);
+
+		/// Get a connection from the pool, blocking until one is available.
+		/// Callers are served in the order they asked. Within a TransactionScope on one of this pool's
+		/// connections, that connection is returned immediately (as for all the get functions).
+		ConnectionHandle get();
+		/// Get a connection from the pool, waiting at most timeout milliseconds for one to become available.
+		/// @throws AdHoc::TimeOutOnResourcePool if none became available in time.
+		ConnectionHandle get(unsigned int timeout);
+		/// Get a connection from the pool, waiting until at most deadline for one to become available.
+		/// @throws AdHoc::TimeOutOnResourcePool if none became available in time.
+		ConnectionHandle get(std::chrono::steady_clock::time_point deadline);
+		/// Get a connection from the pool without blocking the caller, which takes its place in the queue
+		/// immediately. Queued requests are served by a thread belonging to the pool, so the handle is not
+		/// registered to the caller's thread (see getMine). The pool must outlive the request.
+		/// @param deadline Time after which the request fails with AdHoc::TimeOutOnResourcePool instead.
+		PendingConnection getAsync(std::optional<std::chrono::steady_clock::time_point> deadline = {});
+
+		/// Get a connection from the pool with a select command for the given SQL. Commands are kept per
+		/// connection and reused by later checkouts of that connection. Only thread-affinity mode looks for an
+		/// idle connection which already has the command; in shared mode the command is reused only when the
+		/// pool happens to hand out such a connection. The options of the first preparation on each connection
+		/// apply.
+		PooledCommand<SelectCommand> getSelect(const std::string & sql, const CommandOptionsCPtr & = nullptr);
+		/// Get a connection from the pool with a modify command for the given SQL (see getSelect).
+		PooledCommand<ModifyCommand> getModify(const std::string & sql, const CommandOptionsCPtr & = nullptr);
+
+		/// Statistics about the pool's use so far. Hold times are only recorded in shared mode.
+		[[nodiscard]] ConnectionPoolMetrics metrics() const;
+		/// Number of connections checked out, excluding idle ones held in thread-affinity slots.
+		[[nodiscard]] unsigned int inUseCount() const;
+		/// Number of idle connections, including those held in thread-affinity slots.
+		[[nodiscard]] unsigned int availableCount() const;
+
+		/// Connections active more recently than this are handed out without a ping (zero always pings).
+		/// Set before the pool is in use.
+		std::chrono::milliseconds pingAfterIdle {0};
+
+		/// Script to execute on each new connection, whether opened by warm or on demand.
+		/// Set before the pool is in use.
+		std::filesystem::path initScript;
+
+		/// Open connections ahead of demand, concurrently, and make them available in the pool.
+		/// Connections are placed in the pool without waiting; any which can't be (the pool is busy or others
+		/// are queued for it) are used the next time the pool needs a new connection.
+		/// @param n Number of connections wanted available (capped at keep, less those already open).
+		/// @param parallelism Maximum number of connections to open at once.
+		/// @return Time taken until all connections were ready.
+		std::chrono::steady_clock::duration warm(unsigned int n, unsigned int parallelism);
+
+		/// Perform a maintenance pass now: close expired idle connections, then open connections up to minOpen.
+		/// Connections in use are left alone, and none are opened to be inspected.
+		void maintain(const ConnectionPoolMaintenance &);
 
 	protected:
-		/// Ping a connection.
+		/// Provide a connection for the pool; implementations of createResource should use this. Takes a
+		/// connection opened by warm if there is one, otherwise opens one with open; either way it is initialised
+		/// and tracked by the pool.
+		[[nodiscard]] ConnectionPtr createConnection(const std::function<ConnectionPtr()> & open) const;
+
+		/// Check a connection is fit for return (no failure recorded, no open transaction) and record its activity.
 		void returnTestResource(Connection const *) const override;
-		/// Ping a connection.
+		/// Ping a connection, unless it has been active recently.
 		void testResource(Connection const *) const override;
+		/// Called after each successful ping with the time it took.
+		virtual void pinged(std::chrono::steady_clock::duration) const;
+
+		/// Mark a connection to be closed instead of kept when next returned to the pool.
+		void retire(Connection const *) const;
+
+	private:
+		struct Slot;
+		struct PreparedCommands;
+
+		DLL_PRIVATE ConnectionPtr takeWarmed() const;
+		// Run the init script and wrap the connection so the pool's commands for it are released before it closes
+		DLL_PRIVATE ConnectionPtr adopt(ConnectionPtr) const;
+
+		DLL_PRIVATE std::optional<ConnectionHandle> claimIdle(Slot &, std::optional<std::size_t> withCommand) const;
+		DLL_PRIVATE std::optional<ConnectionHandle> claimAnyIdle(std::optional<std::size_t> withCommand) const;
+		DLL_PRIVATE bool store(Slot &, const ConnectionHandle &) const;
+		DLL_PRIVATE unsigned int idleSlotted() const;
+		DLL_PRIVATE void announceRelease() const;
+		using Waiters = std::list<std::shared_ptr<PendingConnection::Request>>;
+
+		DLL_PRIVATE ConnectionHandle acquire(const std::optional<std::chrono::steady_clock::time_point> & deadline,
+				std::optional<std::size_t> withCommand = {});
+		DLL_PRIVATE std::optional<ConnectionHandle> claimIdleUnqueued(std::optional<std::size_t> withCommand);
+		DLL_PRIVATE std::optional<ConnectionHandle> inCurrentTransaction();
+		DLL_PRIVATE Waiters::iterator enqueue(std::shared_ptr<PendingConnection::Request>);
+		DLL_PRIVATE void leave(Waiters::iterator);
+		DLL_PRIVATE ConnectionHandle queued(
+				Waiters::iterator, const std::optional<std::chrono::steady_clock::time_point> & deadline);
+		DLL_PRIVATE ConnectionHandle checkout(const std::optional<std::chrono::steady_clock::time_point> & deadline);
+		DLL_PRIVATE ConnectionHandle checkedOutSince(ConnectionHandle, std::chrono::steady_clock::time_point start);
+		// Call with waitersLock held
+		DLL_PRIVATE std::optional<std::chrono::steady_clock::time_point> sweep();
+		DLL_PRIVATE void dispatch();
+		DLL_PRIVATE void serve(Waiters::iterator);
+
+		const unsigned int keepOpen;
+		mutable std::vector<Slot> slots;
+		// Where to start looking for any idle slot, rotated to spread claims out
+		mutable std::atomic<std::size_t> nextSlot {0};
+		// Counts connections returned to the shared pool and slots emptied, for threads waiting on either
+		mutable std::mutex releasesLock;
+		mutable std::condition_variable releasesChanged;
+		mutable uint64_t releases {0};
+		mutable std::mutex warmedLock;
+		mutable std::vector<ConnectionPtr> warmed;
+		mutable std::mutex retiringLock;
+		mutable std::set<Connection const *> retiring;
+		// Shared with connections, which may outlive the pool
+		const std::shared_ptr<PreparedCommands> preparedCommands;
+
+		std::mutex waitersLock;
+		std::condition_variable waitersChanged;
+		Waiters waiters;
+		std::atomic<std::size_t> waiting {0};
+		// Serves queued getAsync requests, started by the first
+		bool dispatchStopping {false};
+		std::thread dispatcher;
+
+		std::atomic<uint64_t> checkouts {0};
+		std::atomic<uint64_t> timeouts {0};
+		mutable std::atomic<uint64_t> pingFailures {0};
+		LatencyHistogram checkoutWait;
+		mutable LatencyHistogram holdTime;
+		mutable LatencyHistogram createTime;
+		mutable LatencyHistogram pingTime;
+		mutable std::mutex checkedOutLock;
+		struct CheckedOut {
+			std::chrono::steady_clock::time_point since;
+			std::weak_ptr<Connection> connection;
+			// Shared by the handles lent within a TransactionScope on the connection. Held twice, so releasing a
+			// lent handle never finds just one other holder, which is how a handle knows to return its connection:
+			// only the checkout's own handles do that, and they must outlive those lent.
+			std::array<std::shared_ptr<ConnectionHandle::Object>, 2> lent;
+		};
+		mutable std::map<Connection const *, CheckedOut> checkedOut;
 	};
 
 	/// Standard specialisation of AdHoc::ResourcePool for database connections given a type and connection string.
@@ -33,17 +267,48 @@ namespace DB {
 		/// @param keep Number of connections to keep open after use.
 		/// @param type Database connection factory name.
 		/// @param connectionString Connection string to pass to the connection factory.
-		ConnectionPool(unsigned int max, unsigned int keep, const std::string & type, std::string connectionString);
+		/// @param mode How connections are handed out.
+		ConnectionPool(unsigned int max, unsigned int keep, const std::string & type, std::string connectionString,
+				ConnectionPoolMode mode = ConnectionPoolMode::Shared);
 
 	protected:
 		/// Create a new connection.
 		ConnectionPtr createResource() const override;
+		/// Open a new connection to the database, without the pool's tracking (see createConnection).
+		[[nodiscard]] ConnectionPtr connect() const;
 
 	private:
 		const ConnectionFactoryCPtr factory;
 		const std::string connectionString;
 	};
 
+	/// Background maintenance of a connection pool (see BasicConnectionPool::maintain), run every interval for as
+	/// long as this object exists. It must be destroyed before the pool.
+	class DLL_PUBLIC ConnectionPoolMaintainer {
+	public:
+		/// Start maintaining a pool.
+		/// @param pool The pool to maintain.
+		/// @param settings What to maintain and how often.
+		/// @throws std::invalid_argument if settings.interval is not positive.
+		ConnectionPoolMaintainer(BasicConnectionPool & pool, ConnectionPoolMaintenance settings);
+		/// Stop maintaining the pool, waiting for any pass in progress.
+		~ConnectionPoolMaintainer();
+		/// Standard special members
+		SPECIAL_MEMBERS_COPY(ConnectionPoolMaintainer, delete);
+		/// Standard special members
+		SPECIAL_MEMBERS_MOVE(ConnectionPoolMaintainer, delete);
+
+	private:
+		DLL_PRIVATE void run();
+
+		BasicConnectionPool & pool;
+		const ConnectionPoolMaintenance settings;
+		std::mutex stateLock;
+		std::condition_variable wake;
+		bool stopping {false};
+		std::thread maintenance;
+	};
+
 	using ConnectionPoolPtr = std::shared_ptr<BasicConnectionPool>;
 }
 
@@ -0,0 +1,157 @@
+#include "copyTable.h"
+#include "boundedQueue.h"
+#include "bulkRowWriter.h"
+#include "column.h"
+#include "connection.h"
+#include "dbTypes.h"
+#include "selectcommand.h"
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <exception>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace DB {
+	namespace {
+		/// Rows decoded from the source, stored flat (columns per row consecutively).
+		struct CopyBatch {
+			std::size_t rows {0};
+			std::vector<FieldValue> values;
+		};
+	}
+
+	static void
+	decodeRows(SelectCommand & sel, BoundedQueue<CopyBatch> & batches, std::size_t batchRows)
+	{
+		CopyBatch batch;
+		CaptureFieldValue capture(batch.values);
+		while (sel.fetch()) {
+			if (!sel.columnCount()) {
+				// Nothing to write for each row, nor to tell where one ends
+				throw ColumnIndexOutOfRange(0);
+			}
+			for (unsigned int c = 0; c < sel.columnCount(); c++) {
+				sel[c].apply(capture);
+			}
+			if (++batch.rows >= batchRows) {
+				if (!batches.push(std::exchange(batch, {}))) {
+					return;
+				}
+			}
+		}
+		if (batch.rows) {
+			batches.push(std::move(batch));
+		}
+	}
+
+	static uint64_t
+	encodeRows(BoundedQueue<CopyBatch> & batches, BoundedQueue<std::string> & chunks, const CopyTableOptions & opts)
+	{
+		uint64_t rows = 0, pending = 0;
+		std::string chunk;
+		BulkRowWriter writer(chunk, opts.blobFormat);
+		const auto push = [&]() {
+			if (!chunks.push(std::exchange(chunk, {}))) {
+				return false;
+			}
+			rows += std::exchange(pending, 0);
+			return true;
+		};
+		while (const auto batch = batches.pop()) {
+			const auto columns = batch->values.size() / batch->rows;
+			for (std::size_t v = 0; v < batch->values.size(); v++) {
+				std::visit(
+						[&writer](const auto & value) {
+							if constexpr (std::is_same_v<std::decay_t<decltype(value)>, std::vector<unsigned char>>) {
+								writer.blob(Blob {value.data(), value.size()});
+							}
+							else {
+								writer.value(value);
+							}
+						},
+						batch->values[v]);
+				if ((v + 1) % columns == 0) {
+					writer.endRow();
+					pending += 1;
+				}
+			}
+			if (chunk.length() >= opts.chunkSize && !push()) {
+				return rows;
+			}
+		}
+		if (!chunk.empty()) {
+			push();
+		}
+		return rows;
+	}
+
+	uint64_t
+	copyTable(SelectCommand & sel, Connection & dest, const std::string & table, const CopyTableOptions & opts)
+	{
+		BoundedQueue<CopyBatch> batches(opts.queueDepth);
+		BoundedQueue<std::string> chunks(opts.queueDepth);
+		std::exception_ptr decodeError, encodeError;
+		uint64_t rows = 0;
+
+		dest.beginBulkUpload(table.c_str(), opts.uploadOptions.c_str());
+		std::thread decoder([&sel, &batches, &decodeError, &opts]() {
+			try {
+				decodeRows(sel, batches, opts.batchRows ? opts.batchRows : 1);
+			}
+			catch (...) {
+				decodeError = std::current_exception();
+			}
+			batches.close();
+		});
+		std::thread encoder([&batches, &chunks, &encodeError, &rows, &opts]() {
+			try {
+				rows = encodeRows(batches, chunks, opts);
+			}
+			catch (...) {
+				encodeError = std::current_exception();
+			}
+			// Stop the decoder too if encoding stopped early
+			batches.close();
+			chunks.close();
+		});
+		const auto join = [&]() {
+			decoder.join();
+			encoder.join();
+		};
+
+		try {
+			while (const auto chunk = chunks.pop()) {
+				dest.bulkUploadData(chunk->data(), chunk->length());
+			}
+		}
+		catch (...) {
+			batches.close();
+			chunks.close();
+			join();
+			abortBulkUpload(dest, "copyTable upload failed");
+			throw;
+		}
+		join();
+		if (decodeError) {
+			abortBulkUpload(dest, "copyTable source failed");
+			std::rethrow_exception(decodeError);
+		}
+		if (encodeError) {
+			abortBulkUpload(dest, "copyTable encoding failed");
+			std::rethrow_exception(encodeError);
+		}
+		dest.endBulkUpload(nullptr);
+		return rows;
+	}
+
+	uint64_t
+	copyTable(Connection & src, const std::string & query, Connection & dest, const std::string & table,
+			const CopyTableOptions & opts)
+	{
+		auto sel = src.select(query);
+		return copyTable(*sel, dest, table, opts);
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef DB_COPYTABLE_H
+#define DB_COPYTABLE_H
+
+#include "bulkRowWriter.h"
+#include "command_fwd.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <visibility.h>
+
+namespace DB {
+	class Connection;
+	class SelectCommand;
+
+	/// Options controlling a copyTable operation.
+	struct CopyTableOptions {
+		/// Database specific options to the bulk upload command.
+		std::string uploadOptions;
+		/// Maximum number of batches/chunks queued between each pair of threads.
+		std::size_t queueDepth {16};
+		/// Number of decoded rows handed from the decoding thread to the encoding thread at once.
+		std::size_t batchRows {256};
+		/// Size at which an encoded chunk is handed to the uploading thread.
+		std::size_t chunkSize {64 * 1024};
+		/// How binary values are written; Hex suits PostgreSQL, Escaped suits MySQL.
+		BulkBlobFormat blobFormat {BulkBlobFormat::Hex};
+	};
+
+	/// Stream the rows of a select command into a table via a bulk upload on another connection.
+	/// Rows are fetched and decoded on one thread, encoded on a second and uploaded on the calling thread.
+	/// @param sel The select command producing the rows (already bound).
+	/// @param dest The connection to upload to (may be a different connector type).
+	/// @param table The target table (and optionally column list).
+	/// @param opts Copy options.
+	/// @return The number of rows copied.
+	/// @throws ColumnIndexOutOfRange if the select returns rows without columns.
+	DLL_PUBLIC uint64_t copyTable(
+			SelectCommand & sel, Connection & dest, const std::string & table, const CopyTableOptions & opts = {});
+
+	/// Stream the results of a query on one connection into a table on another.
+	/// @param src The connection to run the query on.
+	/// @param query The query producing the rows.
+	/// @param dest The connection to upload to (may be a different connector type).
+	/// @param table The target table (and optionally column list).
+	/// @param opts Copy options.
+	/// @return The number of rows copied.
+	DLL_PUBLIC uint64_t copyTable(Connection & src, const std::string & query, Connection & dest,
+			const std::string & table, const CopyTableOptions & opts = {});
+}
+
+#endif
@@ -14,6 +14,10 @@ namespace DB {
 	class DLL_PUBLIC BulkUploadNotSupported : public Error {
 	};
 
+	/// Exception thrown when attempting to bulk download with a connector that doesn't support it.
+	class DLL_PUBLIC BulkDownloadNotSupported : public Error {
+	};
+
 	/// Exception thrown when a query returns an unsupported column type.
 	class DLL_PUBLIC ColumnTypeNotSupported : public Error {
 	};
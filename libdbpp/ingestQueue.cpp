@@ -0,0 +1,207 @@
+#include "ingestQueue.h"
+#include "connection.h"
+#include "connectionPool.h"
+#include <c++11Helpers.h>
+#include <map>
+#include <memory>
+#include <utility>
+
+namespace DB {
+	struct IngestQueue::ThreadBuffer {
+		struct Chunk {
+			std::string data;
+			std::size_t rows {0};
+		};
+
+		ThreadBuffer() = default;
+		~ThreadBuffer()
+		{
+			delete chunk.load();
+		}
+		SPECIAL_MEMBERS_COPY(ThreadBuffer, delete);
+		SPECIAL_MEMBERS_MOVE(ThreadBuffer, delete);
+
+		/// Rows not yet taken by the flusher. Whoever exchanges it for null owns it: the producer puts it back
+		/// after appending, the flusher keeps it, so the producer starts a new one next time.
+		std::atomic<Chunk *> chunk {nullptr};
+		/// The owning thread has exited; the flusher removes the buffer once it is drained.
+		std::atomic<bool> released {false};
+	};
+
+	static std::atomic<uint64_t> nextQueueId {0};
+
+	IngestQueue::IngestQueue(BasicConnectionPool & p, std::string table, std::vector<std::string> columns,
+			IngestQueueOptions o, IngestReporter r) :
+		pool(p),
+		target(bulkUploadTarget(table, columns)), opts(std::move(o)), reporter(std::move(r)), id(nextQueueId++),
+		flusher(&IngestQueue::run, this)
+	{
+	}
+
+	IngestQueue::~IngestQueue()
+	{
+		{
+			std::lock_guard<std::mutex> l(stateLock);
+			stopping = true;
+		}
+		wake.notify_all();
+		flusher.join();
+	}
+
+	std::string &
+	IngestQueue::scratch()
+	{
+		thread_local std::string row;
+		return row;
+	}
+
+	uint64_t
+	IngestQueue::dropped() const
+	{
+		return droppedRows;
+	}
+
+	bool
+	IngestQueue::admit(std::size_t len)
+	{
+		auto cur = pendingBytes.load();
+		do {
+			// Always admit into an empty queue so oversized rows cannot block forever
+			if (cur && cur + len > opts.maxBytes) {
+				return false;
+			}
+		} while (!pendingBytes.compare_exchange_weak(cur, cur + len));
+		return true;
+	}
+
+	IngestQueue::ThreadBuffer &
+	IngestQueue::threadBuffer()
+	{
+		// This thread's buffer in each queue, released to the queue's flusher when the thread exits
+		struct Mine {
+			Mine() = default;
+			~Mine()
+			{
+				for (const auto & buffer : buffers) {
+					if (auto b = buffer.second.lock()) {
+						b->released = true;
+					}
+				}
+			}
+			SPECIAL_MEMBERS_COPY(Mine, delete);
+			SPECIAL_MEMBERS_MOVE(Mine, delete);
+
+			std::map<uint64_t, std::weak_ptr<ThreadBuffer>> buffers;
+		};
+
+		thread_local Mine mine;
+		if (auto i = mine.buffers.find(id); i != mine.buffers.end()) {
+			if (auto b = i->second.lock()) {
+				return *b;
+			}
+		}
+		// Forget buffers of queues which have since been destroyed
+		std::erase_if(mine.buffers, [](const auto & buffer) {
+			return buffer.second.expired();
+		});
+		auto b = std::make_shared<ThreadBuffer>();
+		mine.buffers[id] = b;
+		std::lock_guard<std::mutex> l(buffersLock);
+		return *buffers.emplace_back(std::move(b));
+	}
+
+	bool
+	IngestQueue::append(const std::string & row)
+	{
+		if (!admit(row.length())) {
+			if (opts.overflow == IngestOverflowPolicy::Drop) {
+				droppedRows += 1;
+				return false;
+			}
+			std::unique_lock<std::mutex> l(spaceLock);
+			spaceAvailable.wait(l, [this, &row]() {
+				return admit(row.length());
+			});
+		}
+		auto & buffer = threadBuffer();
+		std::unique_ptr<ThreadBuffer::Chunk> chunk {buffer.chunk.exchange(nullptr)};
+		if (!chunk) {
+			chunk = std::make_unique<ThreadBuffer::Chunk>();
+		}
+		chunk->data.append(row);
+		chunk->rows += 1;
+		buffer.chunk = chunk.release();
+		return true;
+	}
+
+	void
+	IngestQueue::run()
+	{
+		std::unique_lock<std::mutex> l(stateLock);
+		for (bool stop = false; !stop;) {
+			wake.wait_for(l, opts.interval, [this]() {
+				return stopping;
+			});
+			stop = stopping;
+			l.unlock();
+			flush();
+			l.lock();
+		}
+	}
+
+	void
+	IngestQueue::flush()
+	{
+		std::vector<std::string> batch;
+		IngestFlushReport report {};
+		{
+			std::lock_guard<std::mutex> l(buffersLock);
+			std::erase_if(buffers, [&batch, &report](const auto & buffer) {
+				// Once released, the producer's last chunk is already in place
+				const bool released = buffer->released;
+				// Null if empty, or if the producer is appending; its rows wait for the next flush
+				if (std::unique_ptr<ThreadBuffer::Chunk> chunk {buffer->chunk.exchange(nullptr)}) {
+					report.rows += chunk->rows;
+					report.bytes += chunk->data.length();
+					batch.emplace_back(std::move(chunk->data));
+				}
+				return released;
+			});
+		}
+		if (batch.empty()) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> l(spaceLock);
+			pendingBytes -= report.bytes;
+		}
+		spaceAvailable.notify_all();
+
+		const auto start = std::chrono::steady_clock::now();
+		try {
+			auto c = pool.get();
+			c->beginBulkUpload(target.c_str(), opts.uploadOptions.c_str());
+			try {
+				for (const auto & data : batch) {
+					c->bulkUploadData(data.data(), data.length());
+				}
+			}
+			catch (const std::exception & e) {
+				abortBulkUpload(*c.get(), e.what());
+				throw;
+			}
+			catch (...) {
+				abortBulkUpload(*c.get(), "IngestQueue flush failed");
+				throw;
+			}
+			c->endBulkUpload(nullptr);
+		}
+		catch (...) {
+			report.error = std::current_exception();
+		}
+		report.latency = std::chrono::steady_clock::now() - start;
+		if (reporter) {
+			reporter(report);
+		}
+	}
+}
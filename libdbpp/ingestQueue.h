@@ -0,0 +1,128 @@
+#ifndef DB_INGESTQUEUE_H
+#define DB_INGESTQUEUE_H
+
+#include "bulkRowWriter.h"
+#include <atomic>
+#include <c++11Helpers.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <visibility.h>
+
+namespace DB {
+	class BasicConnectionPool;
+
+	/// What an IngestQueue does with rows pushed while it is full.
+	enum class IngestOverflowPolicy {
+		/// Wait for the next flush to make room.
+		Block,
+		/// Reject the row.
+		Drop,
+	};
+
+	/// Options controlling an IngestQueue.
+	struct IngestQueueOptions {
+		/// Time between flushes.
+		std::chrono::milliseconds interval {100};
+		/// Maximum size of rows held between flushes.
+		std::size_t maxBytes {64 * 1024 * 1024};
+		/// Behaviour when maxBytes is reached.
+		IngestOverflowPolicy overflow {IngestOverflowPolicy::Block};
+		/// Database specific options to the bulk upload command.
+		std::string uploadOptions;
+	};
+
+	/// Outcome of one IngestQueue flush.
+	struct IngestFlushReport {
+		/// Number of rows in the batch.
+		std::size_t rows;
+		/// Size of the batch.
+		std::size_t bytes;
+		/// Time taken to get a connection and upload the batch.
+		std::chrono::steady_clock::duration latency;
+		/// The failure, if the batch could not be written (the rows are lost).
+		std::exception_ptr error;
+	};
+
+	/// Callback receiving the outcome of each flush.
+	using IngestReporter = std::function<void(const IngestFlushReport &)>;
+
+	/// Thread-safe multi-producer queue of rows which a background thread periodically bulk uploads to a table
+	/// through a connection pool. Each producer thread appends to its own buffer, which it hands to and from the
+	/// flusher with atomic exchanges, so pushing takes no lock unless the queue is full and the policy is to block
+	/// (a thread's first push to a queue also registers its buffer under a lock). The flusher takes the buffers
+	/// every interval, and discards a buffer once its thread has exited.
+	class DLL_PUBLIC IngestQueue {
+	public:
+		/// Create a new queue and start its flusher.
+		/// @param pool The pool to take connections from.
+		/// @param table The target table.
+		/// @param columns The target columns, in the order values are given to push().
+		/// @param opts Options.
+		/// @param reporter Optional callback for the outcome of each flush (called on the flusher thread).
+		IngestQueue(BasicConnectionPool & pool, std::string table, std::vector<std::string> columns,
+				IngestQueueOptions opts = {}, IngestReporter reporter = {});
+		/// Stop the flusher after a final flush.
+		~IngestQueue();
+		/// Standard special members
+		SPECIAL_MEMBERS_COPY(IngestQueue, delete);
+		/// Standard special members
+		SPECIAL_MEMBERS_MOVE(IngestQueue, delete);
+
+		/// Queue a row, one value per column.
+		/// @return false if the row was dropped because the queue is full.
+		template<typename... Values>
+		bool
+		push(const Values &... values)
+		{
+			auto & row = scratch();
+			row.clear();
+			BulkRowWriter writer(row);
+			(writer.value(values), ...);
+			writer.endRow();
+			return append(row);
+		}
+
+		/// Number of rows dropped because the queue was full.
+		[[nodiscard]] uint64_t dropped() const;
+
+	private:
+		struct ThreadBuffer;
+
+		DLL_PRIVATE static std::string & scratch();
+		DLL_PRIVATE bool append(const std::string & row);
+		DLL_PRIVATE bool admit(std::size_t);
+		DLL_PRIVATE ThreadBuffer & threadBuffer();
+		DLL_PRIVATE void run();
+		DLL_PRIVATE void flush();
+
+		BasicConnectionPool & pool;
+		const std::string target;
+		const IngestQueueOptions opts;
+		const IngestReporter reporter;
+		const uint64_t id;
+
+		std::mutex buffersLock;
+		std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+
+		std::atomic<std::size_t> pendingBytes {0};
+		std::atomic<uint64_t> droppedRows {0};
+		std::mutex spaceLock;
+		std::condition_variable spaceAvailable;
+
+		std::mutex stateLock;
+		std::condition_variable wake;
+		bool stopping {false};
+		std::thread flusher;
+	};
+}
+
+#endif
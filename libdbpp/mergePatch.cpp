@@ -0,0 +1,105 @@
+#include "mergePatch.h"
+#include "sqlWriter.h"
+#include "tablepatch.h"
+#include <algorithm>
+#include <buffer.h>
+#include <iterator>
+#include <string>
+#include <utility>
+
+namespace DB {
+	static std::vector<std::string>
+	patchColumns(const TablePatch & tp)
+	{
+		std::vector<std::string> columns {tp.pk.begin(), tp.pk.end()};
+		std::copy_if(tp.cols.begin(), tp.cols.end(), std::back_inserter(columns), [&tp](const auto & c) {
+			return !tp.pk.contains(c);
+		});
+		return columns;
+	}
+
+	std::string
+	MergePatchOrderMismatch::message() const noexcept
+	{
+		return "Merge patch rows aren't in ascending key order; check the destination key's collation.";
+	}
+
+	MergePatchBase::MergePatchBase(Connection & c, const TablePatch & p, MergePatchOptions o) :
+		conn(c), tp(p), opts(std::move(o)), columns(patchColumns(tp)),
+		inserter(conn, tp.dest, columns, opts.insertOptions)
+	{
+		if (tp.pk.empty() || opts.deleteBatch == 0) {
+			throw PatchCheckFailure();
+		}
+		if (!conn.inTx()) {
+			throw TransactionRequired();
+		}
+	}
+
+	SelectCommandPtr
+	MergePatchBase::destination()
+	{
+		AdHoc::Buffer sql;
+		sql.append("SELECT ");
+		for (auto c = columns.begin(); c != columns.end(); ++c) {
+			sql.appendbf(c == columns.begin() ? "a.%s" : ", a.%s", *c);
+		}
+		sql.appendbf(" FROM %s a", tp.dest);
+		if (tp.where) {
+			sql.append(" WHERE ");
+			tp.where->writeSql(sql);
+		}
+		sql.append(" ORDER BY ");
+		for (auto k = tp.pk.begin(); k != tp.pk.end(); ++k) {
+			sql.appendbf(k == tp.pk.begin() ? "a.%s" : ", a.%s", *k);
+		}
+		auto sel = conn.select(sql);
+		if (tp.where) {
+			unsigned int offset = 0;
+			tp.where->bindParams(sel.get(), offset);
+		}
+		return sel;
+	}
+
+	ModifyCommandPtr
+	MergePatchBase::deleter(std::size_t rows, unsigned int & offset)
+	{
+		AdHoc::Buffer sql;
+		if (tp.insteadOfDelete) {
+			sql.appendbf("UPDATE %s SET ", tp.dest);
+			tp.insteadOfDelete->writeSql(sql);
+			sql.append(" WHERE ");
+		}
+		else {
+			sql.appendbf("DELETE FROM %s WHERE ", tp.dest);
+		}
+		for (std::size_t r = 0; r < rows; r++) {
+			sql.append(r ? " OR (" : "(");
+			for (auto k = tp.pk.begin(); k != tp.pk.end(); ++k) {
+				sql.appendbf(k == tp.pk.begin() ? "%s = ?" : " AND %s = ?", *k);
+			}
+			sql.append(")");
+		}
+		auto del = conn.modify(sql);
+		offset = 0;
+		if (tp.insteadOfDelete) {
+			tp.insteadOfDelete->bindParams(del.get(), offset);
+		}
+		return del;
+	}
+
+	ModifyCommandPtr
+	MergePatchBase::updater()
+	{
+		AdHoc::Buffer sql;
+		sql.appendbf("UPDATE %s SET ", tp.dest);
+		for (auto c = columns.begin() + static_cast<std::ptrdiff_t>(tp.pk.size()); c != columns.end(); ++c) {
+			sql.appendbf(c == columns.begin() + static_cast<std::ptrdiff_t>(tp.pk.size()) ? "%s = ?" : ", %s = ?", *c);
+		}
+		sql.append(" WHERE ");
+		for (auto k = tp.pk.begin(); k != tp.pk.end(); ++k) {
+			sql.appendbf(k == tp.pk.begin() ? "%s = ?" : " AND %s = ?", *k);
+		}
+		return conn.modify(sql);
+	}
+}
@@ -0,0 +1,267 @@
+#ifndef DB_MERGEPATCH_H
+#define DB_MERGEPATCH_H
+
+#include "bufferedInserter.h"
+#include "command_fwd.h"
+#include "connection.h"
+#include "modifycommand.h"
+#include "selectcommand.h"
+#include <c++11Helpers.h>
+#include <cstddef>
+#include <exception.h>
+#include <optional>
+#include <ranges>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <visibility.h>
+
+namespace DB {
+	class TablePatch;
+
+	/// Options controlling a mergePatchTable operation.
+	struct MergePatchOptions {
+		/// Keys per batched delete statement.
+		std::size_t deleteBatch {500};
+		/// Options for buffering and writing new rows.
+		BufferedInserterOptions insertOptions;
+	};
+
+	/// Exception thrown when a merge patch's source or destination isn't in strictly ascending key order, as
+	/// compared by the key types' operator<. The patch's changes are rolled back.
+	class DLL_PUBLIC MergePatchOrderMismatch : public AdHoc::StdException {
+	private:
+		std::string message() const noexcept override;
+	};
+
+	/// @cond
+	class DLL_PUBLIC MergePatchBase {
+	protected:
+		MergePatchBase(Connection & conn, const TablePatch & tp, MergePatchOptions opts);
+
+		SelectCommandPtr destination();
+		ModifyCommandPtr deleter(std::size_t rows, unsigned int & offset);
+		ModifyCommandPtr updater();
+
+		Connection & conn;
+		const TablePatch & tp;
+		const MergePatchOptions opts;
+		// pk then the remaining cols, the order of the values in each row
+		std::vector<std::string> columns;
+		BufferedInserter inserter;
+		ModifyCommandPtr update;
+		ModifyCommandPtr batchDelete;
+		unsigned int batchDeleteOffset {0};
+	};
+
+	template<std::size_t Keys, typename Row> class MergePatch : private MergePatchBase {
+	public:
+		static constexpr auto Width = std::tuple_size_v<Row>;
+		static_assert(Keys > 0 && Keys <= Width);
+
+		MergePatch(Connection & c, const TablePatch & p, MergePatchOptions o) :
+			MergePatchBase(c, p, std::move(o))
+		{
+			if (columns.size() != Width) {
+				throw PatchCheckFailure();
+			}
+		}
+
+		template<typename Rows>
+		PatchResult
+		operator()(const Rows & source)
+		{
+			TransactionScope tx(conn);
+			auto dest = destination();
+			// Each side is checked to be in the order compareKeys expects; merging anything else would delete and
+			// reinsert rows that are there
+			Row d, next;
+			bool haveDest = fetch(dest, d);
+			const auto advance = [&dest, &d, &next]() {
+				if (!fetch(dest, next)) {
+					return false;
+				}
+				if (compareKeys(next, d) <= 0) {
+					throw MergePatchOrderMismatch();
+				}
+				std::swap(d, next);
+				return true;
+			};
+			std::optional<Row> last;
+			for (const Row & s : source) {
+				if (last && compareKeys(s, *last) <= 0) {
+					throw MergePatchOrderMismatch();
+				}
+				last = s;
+				int c = 0;
+				while (haveDest && (c = compareKeys(s, d)) > 0) {
+					remove(d);
+					haveDest = advance();
+				}
+				if (haveDest && c == 0) {
+					if (!equalValues(s, d)) {
+						change(s);
+					}
+					haveDest = advance();
+				}
+				else {
+					add(s);
+				}
+			}
+			while (haveDest) {
+				remove(d);
+				haveDest = advance();
+			}
+			flushDeletes();
+			inserter.flush();
+			return result;
+		}
+
+	private:
+		static bool
+		fetch(const SelectCommandPtr & sel, Row & row)
+		{
+			if (!sel->fetch()) {
+				return false;
+			}
+			read(*sel, row, std::make_index_sequence<Width> {});
+			return true;
+		}
+
+		template<std::size_t... I>
+		static void
+		read(const SelectCommand & sel, Row & row, std::index_sequence<I...>)
+		{
+			((sel[I] >> std::get<I>(row)), ...);
+		}
+
+		template<std::size_t... I>
+		static void
+		bind(Command * cmd, unsigned int & offset, const Row & row, std::index_sequence<I...>)
+		{
+			(cmd->bindParam(offset++, std::get<I>(row)), ...);
+		}
+
+		template<std::size_t I = 0>
+		static int
+		compareKeys(const Row & s, const Row & d)
+		{
+			if constexpr (I < Keys) {
+				if (std::get<I>(s) < std::get<I>(d)) {
+					return -1;
+				}
+				if (std::get<I>(d) < std::get<I>(s)) {
+					return 1;
+				}
+				return compareKeys<I + 1>(s, d);
+			}
+			else {
+				return 0;
+			}
+		}
+
+		template<std::size_t I = Keys>
+		static bool
+		equalValues(const Row & s, const Row & d)
+		{
+			if constexpr (I < Width) {
+				return std::get<I>(s) == std::get<I>(d) && equalValues<I + 1>(s, d);
+			}
+			else {
+				return true;
+			}
+		}
+
+		template<std::size_t... I>
+		static auto
+		offsetSequence(std::index_sequence<I...>)
+		{
+			return std::index_sequence<(Keys + I)...> {};
+		}
+
+		void
+		add(const Row & s)
+		{
+			std::apply(
+					[this](const auto &... values) {
+						inserter.add(values...);
+					},
+					s);
+			result.inserts += 1;
+		}
+
+		void
+		change(const Row & s)
+		{
+			if (!update) {
+				update = updater();
+			}
+			unsigned int offset = 0;
+			bind(update.get(), offset, s, offsetSequence(std::make_index_sequence<Width - Keys> {}));
+			bind(update.get(), offset, s, std::make_index_sequence<Keys> {});
+			result.updates += update->execute();
+		}
+
+		void
+		remove(const Row & d)
+		{
+			pendingDeletes.emplace_back(d);
+			if (pendingDeletes.size() >= opts.deleteBatch) {
+				flushDeletes();
+			}
+		}
+
+		void
+		flushDeletes()
+		{
+			if (pendingDeletes.empty()) {
+				return;
+			}
+			auto del = [this]() {
+				if (pendingDeletes.size() == opts.deleteBatch) {
+					if (!batchDelete) {
+						batchDelete = deleter(pendingDeletes.size(), batchDeleteOffset);
+					}
+					return std::make_pair(batchDelete, batchDeleteOffset);
+				}
+				unsigned int offset = 0;
+				auto partial = deleter(pendingDeletes.size(), offset);
+				return std::make_pair(partial, offset);
+			}();
+			for (const auto & d : pendingDeletes) {
+				bind(del.first.get(), del.second, d, std::make_index_sequence<Keys> {});
+			}
+			result.deletes += del.first->execute();
+			pendingDeletes.clear();
+		}
+
+		std::vector<Row> pendingDeletes;
+		PatchResult result {};
+	};
+	/// @endcond
+
+	/// Patch a table's contents from rows held client side, without staging them in the database.
+	/// The destination is streamed in key order and merged with the source; the differences are written as
+	/// buffered bulk inserts, updates by key (one prepared statement) and batched deletes by key. Memory use is
+	/// bounded by the batch sizes regardless of table size. The connection must support executing statements
+	/// while a select is being fetched (e.g. a cursor).
+	/// Keys are compared with their types' operator<, so the database's ORDER BY must sort them the same way.
+	/// For text keys that means a byte order collation (e.g. a column declared COLLATE "C" in PostgreSQL, or a
+	/// binary one in MySQL); a locale aware collation orders case and punctuation differently. Either side found
+	/// out of order throws MergePatchOrderMismatch rather than being merged.
+	/// @param conn The connection to patch on (must be in a transaction).
+	/// @param tp The patch settings; dest, pk, cols, where and insteadOfDelete are used.
+	/// @param source Rows as tuples of the pk columns then the remaining cols (each in the order of the sets in
+	/// tp), in strictly ascending key order.
+	/// @param opts Batch sizes and options.
+	/// @tparam Keys The number of pk columns.
+	template<std::size_t Keys, std::ranges::input_range Rows>
+	PatchResult
+	mergePatchTable(Connection & conn, const TablePatch & tp, const Rows & source, MergePatchOptions opts = {})
+	{
+		return MergePatch<Keys, std::ranges::range_value_t<Rows>>(conn, tp, std::move(opts))(source);
+	}
+}
+
+#endif
@@ -0,0 +1,219 @@
+#include "multiEndpointPool.h"
+#include "connection.h"
+#include <algorithm>
+#include <exception>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+namespace DB {
+	struct MultiEndpointPool::Suppliers {
+		std::mutex lock;
+		std::map<Connection const *, std::size_t> endpoints;
+	};
+
+	struct MultiEndpointPool::Endpoint : public ConnectionPool {
+		Endpoint(const PoolEndpoint & e, const MultiEndpointPoolOptions & o, std::size_t i,
+				std::shared_ptr<Suppliers> s) :
+			ConnectionPool(o.max, o.keep, e.type, e.connectionString), ejectFor(o.ejectFor),
+			latencyWeight(o.latencyWeight), idx(i), suppliers(std::move(s))
+		{
+		}
+
+		void
+		eject() const
+		{
+			ejectedUntil = (std::chrono::steady_clock::now() + ejectFor).time_since_epoch().count();
+		}
+
+		[[nodiscard]] bool
+		spare() const
+		{
+			return availableCount() > 0 || freeCount() > 0;
+		}
+
+		ConnectionPtr
+		createResource() const override
+		{
+			return createConnection([this]() -> ConnectionPtr {
+				auto c = connect();
+				auto * raw = c.get();
+				{
+					std::lock_guard<std::mutex> l(suppliers->lock);
+					suppliers->endpoints.emplace(raw, idx);
+				}
+				// Forgotten before the connection closes, so a later one at the same address isn't mistaken for it
+				return {raw, [c = std::move(c), s = suppliers](Connection * r) mutable {
+							{
+								std::lock_guard<std::mutex> l(s->lock);
+								s->endpoints.erase(r);
+							}
+							c.reset();
+						}};
+			});
+		}
+
+		void
+		testResource(Connection const * c) const override
+		{
+			try {
+				ConnectionPool::testResource(c);
+			}
+			catch (...) {
+				eject();
+				throw;
+			}
+		}
+
+		void
+		pinged(std::chrono::steady_clock::duration d) const override
+		{
+			const auto sample = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+			const auto update = [this, sample](int64_t avg) {
+				return avg ? avg + static_cast<int64_t>(static_cast<double>(sample - avg) * latencyWeight) : sample;
+			};
+			for (auto avg = latency.load(); !latency.compare_exchange_weak(avg, update(avg));) {
+			}
+		}
+
+		const std::chrono::milliseconds ejectFor;
+		const double latencyWeight;
+		const std::size_t idx;
+		const std::shared_ptr<Suppliers> suppliers;
+		mutable std::atomic<std::chrono::steady_clock::rep> ejectedUntil {0};
+		// Microseconds of ping round trip, exponentially weighted
+		mutable std::atomic<int64_t> latency {0};
+	};
+
+	// Longest get waits on one full endpoint before looking for a connection to spare on any of them
+	static constexpr unsigned int FULL_RECHECK {10};
+
+	MultiEndpointPool::MultiEndpointPool(const std::vector<PoolEndpoint> & es, const MultiEndpointPoolOptions & o) :
+		options(o), suppliers(std::make_shared<Suppliers>())
+	{
+		endpoints.reserve(es.size());
+		for (const auto & e : es) {
+			endpoints.push_back(std::make_unique<Endpoint>(e, options, endpoints.size(), suppliers));
+		}
+	}
+
+	MultiEndpointPool::~MultiEndpointPool() = default;
+
+	std::vector<std::size_t>
+	MultiEndpointPool::preference() const
+	{
+		const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+		// Rotate the starting point so ties are shared out
+		const auto first = rotation++;
+		using Rank = std::tuple<bool, bool, double, std::size_t>;
+		std::vector<Rank> ranks;
+		ranks.reserve(endpoints.size());
+		for (std::size_t n = 0; n < endpoints.size(); n++) {
+			const auto idx = (first + n) % endpoints.size();
+			const auto & e = *endpoints[idx];
+			const auto outstanding = static_cast<double>(e.inUseCount());
+			const auto score = options.selection == EndpointSelection::LatencyWeighted
+					? static_cast<double>(e.latency.load(std::memory_order_relaxed) + 1) * (outstanding + 1)
+					: outstanding;
+			ranks.emplace_back(e.ejectedUntil.load(std::memory_order_relaxed) > now, !e.spare(), score, idx);
+		}
+		std::stable_sort(ranks.begin(), ranks.end(), [](const Rank & a, const Rank & b) {
+			return std::tie(std::get<0>(a), std::get<1>(a), std::get<2>(a))
+					< std::tie(std::get<0>(b), std::get<1>(b), std::get<2>(b));
+		});
+		std::vector<std::size_t> order;
+		order.reserve(ranks.size());
+		std::transform(ranks.begin(), ranks.end(), std::back_inserter(order), [](const Rank & r) {
+			return std::get<3>(r);
+		});
+		return order;
+	}
+
+	ConnectionHandle
+	MultiEndpointPool::get()
+	{
+		std::exception_ptr lastError;
+		// Endpoints which have failed during this call aren't tried again
+		std::vector<bool> failed(endpoints.size());
+		for (;;) {
+			// Take one without waiting from the first endpoint with one to spare
+			std::vector<std::size_t> full;
+			for (const auto idx : preference()) {
+				auto & e = *endpoints[idx];
+				if (failed[idx]) {
+					continue;
+				}
+				if (!e.spare()) {
+					full.push_back(idx);
+					continue;
+				}
+				try {
+					return e.get(0U);
+				}
+				catch (const AdHoc::TimeOutOnResourcePool &) {
+					// Taken meanwhile
+					full.push_back(idx);
+				}
+				catch (const std::exception &) {
+					e.eject();
+					failed[idx] = true;
+					lastError = std::current_exception();
+				}
+			}
+			if (full.empty()) {
+				break;
+			}
+			// The rest are full too, so wait on the preferred one; but not for long, another may free up first
+			auto & e = *endpoints[full.front()];
+			try {
+				return e.get(FULL_RECHECK);
+			}
+			catch (const AdHoc::TimeOutOnResourcePool &) {
+				// Look at them all again
+			}
+			catch (const std::exception &) {
+				e.eject();
+				failed[full.front()] = true;
+				lastError = std::current_exception();
+			}
+		}
+		if (lastError) {
+			std::rethrow_exception(lastError);
+		}
+		throw ConnectionError();
+	}
+
+	void
+	MultiEndpointPool::failed(const ConnectionHandle & h)
+	{
+		std::lock_guard<std::mutex> l(suppliers->lock);
+		if (const auto s = suppliers->endpoints.find(h.get()); s != suppliers->endpoints.end()) {
+			endpoints[s->second]->eject();
+		}
+	}
+
+	std::size_t
+	MultiEndpointPool::endpointCount() const
+	{
+		return endpoints.size();
+	}
+
+	BasicConnectionPool &
+	MultiEndpointPool::endpointPool(std::size_t idx)
+	{
+		return *endpoints.at(idx);
+	}
+
+	bool
+	MultiEndpointPool::ejected(std::size_t idx) const
+	{
+		return endpoints.at(idx)->ejectedUntil.load() > std::chrono::steady_clock::now().time_since_epoch().count();
+	}
+
+	std::chrono::microseconds
+	MultiEndpointPool::latency(std::size_t idx) const
+	{
+		return std::chrono::microseconds(endpoints.at(idx)->latency.load());
+	}
+}
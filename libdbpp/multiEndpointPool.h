@@ -0,0 +1,91 @@
+#ifndef DB_MULTIENDPOINTPOOL_H
+#define DB_MULTIENDPOINTPOOL_H
+
+#include "connectionPool.h"
+#include <atomic>
+#include <c++11Helpers.h>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <visibility.h>
+
+namespace DB {
+	/// A database to connect to.
+	struct PoolEndpoint {
+		/// Database connection factory name.
+		std::string type;
+		/// Connection string to pass to the connection factory.
+		std::string connectionString;
+	};
+
+	/// How a MultiEndpointPool chooses between endpoints.
+	enum class EndpointSelection {
+		/// The endpoint with the fewest connections checked out.
+		LeastOutstanding,
+		/// The endpoint with the lowest recent ping round trip, weighted by connections checked out.
+		LatencyWeighted,
+	};
+
+	/// Options controlling a MultiEndpointPool.
+	struct MultiEndpointPoolOptions {
+		/// Maximum number of concurrent database connections per endpoint.
+		unsigned int max {4};
+		/// Number of connections per endpoint to keep open after use.
+		unsigned int keep {2};
+		/// How endpoints are chosen.
+		EndpointSelection selection {EndpointSelection::LeastOutstanding};
+		/// How long an endpoint is avoided after a connection error.
+		std::chrono::milliseconds ejectFor {30000};
+		/// Weight of each new ping in the latency moving average.
+		double latencyWeight {0.2};
+	};
+
+	/// Pool of connections spread across several equivalent databases (e.g. read replicas).
+	/// Endpoints which fail to connect or ping, or otherwise fail to supply a connection, are ejected for a while,
+	/// unless all are. Endpoints with a connection to spare are preferred over those with none.
+	class DLL_PUBLIC MultiEndpointPool {
+	public:
+		/// Create a pool for the given endpoints.
+		/// @param endpoints The databases to connect to.
+		/// @param opts Pool options.
+		explicit MultiEndpointPool(
+				const std::vector<PoolEndpoint> & endpoints, const MultiEndpointPoolOptions & opts = {});
+		~MultiEndpointPool();
+		/// Standard special members
+		SPECIAL_MEMBERS_COPY(MultiEndpointPool, delete);
+		/// Standard special members
+		SPECIAL_MEMBERS_MOVE(MultiEndpointPool, delete);
+
+		/// Get a connection from the preferred endpoint with one to spare, falling back to the others on failures.
+		/// Only when every endpoint is full does it wait, for whichever endpoint has a connection returned first.
+		ConnectionHandle get();
+		/// Eject the endpoint which supplied a connection, e.g. after a connection error while using it.
+		void failed(const ConnectionHandle &);
+
+		/// Number of endpoints.
+		[[nodiscard]] std::size_t endpointCount() const;
+		/// The pool for an endpoint.
+		[[nodiscard]] BasicConnectionPool & endpointPool(std::size_t);
+		/// Test whether an endpoint is currently ejected.
+		[[nodiscard]] bool ejected(std::size_t) const;
+		/// Recent ping round trip of an endpoint.
+		[[nodiscard]] std::chrono::microseconds latency(std::size_t) const;
+
+	private:
+		struct Endpoint;
+		struct Suppliers;
+
+		DLL_PRIVATE std::vector<std::size_t> preference() const;
+
+		const MultiEndpointPoolOptions options;
+		// Which endpoint each open connection came from, shared with the connections
+		const std::shared_ptr<Suppliers> suppliers;
+		std::vector<std::unique_ptr<Endpoint>> endpoints;
+		mutable std::atomic<std::size_t> rotation {0};
+	};
+}
+
+#endif
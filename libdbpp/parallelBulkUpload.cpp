@@ -0,0 +1,176 @@
+#include "parallelBulkUpload.h"
+#include "boundedQueue.h"
+#include "bulkRowWriter.h"
+#include "connection.h"
+#include "connectionPool.h"
+#include <algorithm>
+#include <exception>
+#include <istream>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace DB {
+	using Connections = std::vector<AdHoc::ResourceHandle<Connection>>;
+
+	static void
+	upload(Connection * c, const std::string & table, const ParallelBulkUploadOptions & opts,
+			BoundedQueue<std::string> & queue)
+	{
+		c->beginBulkUpload(table.c_str(), opts.uploadOptions.c_str());
+		try {
+			while (const auto chunk = queue.pop()) {
+				c->bulkUploadData(chunk->data(), chunk->length());
+			}
+		}
+		catch (...) {
+			abortBulkUpload(*c, "parallelBulkUpload aborted");
+			throw;
+		}
+		c->endBulkUpload(nullptr);
+	}
+
+	static size_t
+	split(const BulkDataReader & read, std::size_t chunkSize, BoundedQueue<std::string> & queue)
+	{
+		size_t total = 0;
+		std::string carry;
+		for (;;) {
+			std::string chunk {std::move(carry)};
+			carry.clear();
+			const auto have = chunk.length();
+			chunk.resize(have + chunkSize);
+			const auto r = read(chunk.data() + have, chunkSize);
+			chunk.resize(have + r);
+			total += r;
+			if (r == 0) {
+				if (!chunk.empty()) {
+					queue.push(std::move(chunk));
+				}
+				return total;
+			}
+			if (const auto eol = chunk.rfind('\n'); eol == std::string::npos) {
+				carry = std::move(chunk);
+			}
+			else {
+				carry.assign(chunk, eol + 1);
+				chunk.resize(eol + 1);
+				if (!queue.push(std::move(chunk))) {
+					return total;
+				}
+			}
+		}
+	}
+
+	size_t
+	parallelBulkUpload(BasicConnectionPool & pool, const std::string & table, const BulkDataReader & read,
+			const ParallelBulkUploadOptions & opts)
+	{
+		Connections conns;
+		const auto n = std::max(1U, opts.connections);
+		conns.reserve(n);
+		while (conns.size() < n && (conns.empty() || pool.freeCount() > 0)) {
+			conns.emplace_back(pool.get());
+		}
+
+		for (auto c = conns.begin(); c != conns.end(); ++c) {
+			try {
+				(*c)->beginTx();
+			}
+			catch (...) {
+				rollbackEach(conns.begin(), c);
+				throw;
+			}
+		}
+
+		BoundedQueue<std::string> queue(conns.size() * 2);
+		std::vector<std::exception_ptr> errors(conns.size() + 1);
+		std::vector<std::thread> workers;
+		workers.reserve(conns.size());
+		try {
+			for (std::size_t w = 0; w < conns.size(); w++) {
+				workers.emplace_back([c = conns[w].get(), &error = errors[w], &table, &opts, &queue]() {
+					try {
+						upload(c, table, opts, queue);
+					}
+					catch (...) {
+						error = std::current_exception();
+						queue.close();
+					}
+				});
+			}
+		}
+		catch (...) {
+			queue.close();
+			std::for_each(workers.begin(), workers.end(), std::mem_fn(&std::thread::join));
+			rollbackEach(conns.begin(), conns.end());
+			throw;
+		}
+		size_t total = 0;
+		try {
+			total = split(read, std::max<std::size_t>(1, opts.chunkSize), queue);
+		}
+		catch (...) {
+			errors.back() = std::current_exception();
+		}
+		queue.close();
+		std::for_each(workers.begin(), workers.end(), std::mem_fn(&std::thread::join));
+
+		auto c = conns.begin();
+		try {
+			if (const auto e = std::find_if(errors.begin(), errors.end(),
+						[](const auto & error) {
+							return static_cast<bool>(error);
+						});
+					e != errors.end()) {
+				std::rethrow_exception(*e);
+			}
+			for (; c != conns.end(); ++c) {
+				(*c)->commitTx();
+			}
+		}
+		catch (...) {
+			rollbackEach(c, conns.end());
+			throw;
+		}
+		return total;
+	}
+
+	size_t
+	parallelBulkUpload(BasicConnectionPool & pool, const std::string & table, std::istream & in,
+			const ParallelBulkUploadOptions & opts)
+	{
+		if (!in.good()) {
+			throw std::runtime_error("Input stream is not good");
+		}
+		return parallelBulkUpload(
+				pool, table,
+				[&in](char * buf, size_t len) {
+					in.read(buf, static_cast<std::streamsize>(len));
+					return static_cast<size_t>(in.gcount());
+				},
+				opts);
+	}
+
+	size_t
+	parallelBulkUpload(
+			BasicConnectionPool & pool, const std::string & table, FILE * in, const ParallelBulkUploadOptions & opts)
+	{
+		if (!in) {
+			throw std::runtime_error("Input file handle is null");
+		}
+		return parallelBulkUpload(
+				pool, table,
+				[in](char * buf, size_t len) {
+					const auto r = fread(buf, 1, len, in);
+					if (const auto err = ferror(in)) {
+						throw std::system_error(err, std::system_category());
+					}
+					return r;
+				},
+				opts);
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef DB_PARALLELBULKUPLOAD_H
+#define DB_PARALLELBULKUPLOAD_H
+
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <visibility.h>
+
+namespace DB {
+	class BasicConnectionPool;
+
+	/// Reader of raw bulk data; fills the buffer and returns the number of bytes read, 0 at the end.
+	using BulkDataReader = std::function<size_t(char *, size_t)>;
+
+	/// Options controlling a parallelBulkUpload operation.
+	struct ParallelBulkUploadOptions {
+		/// Database specific options to the bulk upload command.
+		std::string uploadOptions;
+		/// Maximum number of concurrent bulk uploads (limited by free connections in the pool).
+		unsigned int connections {4};
+		/// Target size of each block of rows handed to an upload.
+		std::size_t chunkSize {1024 * 1024};
+	};
+
+	/// Load newline delimited bulk data into a table using several pooled connections concurrently.
+	/// The input is split at row boundaries and shared between the uploads, each of which runs in its own
+	/// transaction. All transactions are committed once every upload has succeeded, otherwise all are rolled
+	/// back. Note that commits are not atomic across connections.
+	/// @param pool The pool to take connections from.
+	/// @param table The target table.
+	/// @param read The source of the data.
+	/// @param opts Upload options.
+	/// @return The number of bytes loaded.
+	DLL_PUBLIC size_t parallelBulkUpload(BasicConnectionPool & pool, const std::string & table,
+			const BulkDataReader & read, const ParallelBulkUploadOptions & opts = {});
+	/// Load bulk data from a stream (wrapper)
+	DLL_PUBLIC size_t parallelBulkUpload(BasicConnectionPool & pool, const std::string & table, std::istream &,
+			const ParallelBulkUploadOptions & opts = {});
+	/// Load bulk data from a file (wrapper)
+	DLL_PUBLIC size_t parallelBulkUpload(
+			BasicConnectionPool & pool, const std::string & table, FILE *, const ParallelBulkUploadOptions & opts = {});
+}
+
+#endif
@@ -0,0 +1,72 @@
+#include "poolMetrics.h"
+#include <algorithm>
+#include <bit>
+
+namespace DB {
+	// Values below this get a bucket each, above it four per power of two
+	static constexpr uint64_t LINEAR = 4;
+
+	std::size_t
+	LatencyHistogramSnapshot::bucketOf(uint64_t us)
+	{
+		if (us < LINEAR) {
+			return us;
+		}
+		const auto msb = static_cast<unsigned int>(std::bit_width(us) - 1);
+		return (msb - 1) * LINEAR + ((us >> (msb - 2)) & (LINEAR - 1));
+	}
+
+	uint64_t
+	LatencyHistogramSnapshot::bucketFloor(std::size_t bucket)
+	{
+		if (bucket < LINEAR) {
+			return bucket;
+		}
+		const auto msb = bucket / LINEAR + 1;
+		return (LINEAR + bucket % LINEAR) << (msb - 2);
+	}
+
+	std::chrono::microseconds
+	LatencyHistogramSnapshot::mean() const
+	{
+		return count ? total / static_cast<std::chrono::microseconds::rep>(count) : std::chrono::microseconds {0};
+	}
+
+	std::chrono::microseconds
+	LatencyHistogramSnapshot::quantile(double q) const
+	{
+		const auto target = static_cast<uint64_t>(q * static_cast<double>(count));
+		uint64_t seen = 0;
+		for (std::size_t b = 0; b < BUCKETS; b++) {
+			seen += buckets[b];
+			if (seen > target) {
+				return std::min(max, std::chrono::microseconds(bucketFloor(b)));
+			}
+		}
+		return max;
+	}
+
+	void
+	LatencyHistogram::record(std::chrono::steady_clock::duration d)
+	{
+		const auto us = static_cast<uint64_t>(std::max<std::chrono::microseconds::rep>(
+				0, std::chrono::duration_cast<std::chrono::microseconds>(d).count()));
+		buckets[LatencyHistogramSnapshot::bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+		total.fetch_add(us, std::memory_order_relaxed);
+		for (auto m = max.load(std::memory_order_relaxed); m < us && !max.compare_exchange_weak(m, us);) { }
+		count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	LatencyHistogramSnapshot
+	LatencyHistogram::snapshot() const
+	{
+		LatencyHistogramSnapshot s;
+		s.count = count.load(std::memory_order_relaxed);
+		s.total = std::chrono::microseconds(total.load(std::memory_order_relaxed));
+		s.max = std::chrono::microseconds(max.load(std::memory_order_relaxed));
+		for (std::size_t b = 0; b < LatencyHistogramSnapshot::BUCKETS; b++) {
+			s.buckets[b] = buckets[b].load(std::memory_order_relaxed);
+		}
+		return s;
+	}
+}
@@ -0,0 +1,80 @@
+#ifndef DB_POOLMETRICS_H
+#define DB_POOLMETRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <visibility.h>
+
+namespace DB {
+	/// Point in time copy of a LatencyHistogram.
+	struct DLL_PUBLIC LatencyHistogramSnapshot {
+		/// Number of log-linear buckets: four per power of two microseconds.
+		static constexpr std::size_t BUCKETS = 252;
+
+		/// Number of samples recorded.
+		uint64_t count {0};
+		/// Sum of all samples.
+		std::chrono::microseconds total {0};
+		/// Largest sample recorded.
+		std::chrono::microseconds max {0};
+		/// Number of samples in each bucket.
+		std::array<uint64_t, BUCKETS> buckets {};
+
+		/// Mean of all samples.
+		[[nodiscard]] std::chrono::microseconds mean() const;
+		/// Estimate of the value below which the given fraction of samples fall (within 25%).
+		/// @param q Quantile, 0.0 to 1.0.
+		[[nodiscard]] std::chrono::microseconds quantile(double q) const;
+
+		/// The bucket a value is counted in.
+		[[nodiscard]] static std::size_t bucketOf(uint64_t us);
+		/// The smallest value counted in a bucket.
+		[[nodiscard]] static uint64_t bucketFloor(std::size_t bucket);
+	};
+
+	/// Lock-free latency histogram with HDR style log-linear buckets.
+	class DLL_PUBLIC LatencyHistogram {
+	public:
+		/// Record a sample.
+		void record(std::chrono::steady_clock::duration);
+		/// Copy the current state.
+		[[nodiscard]] LatencyHistogramSnapshot snapshot() const;
+
+	private:
+		std::atomic<uint64_t> count {0};
+		std::atomic<uint64_t> total {0};
+		std::atomic<uint64_t> max {0};
+		std::array<std::atomic<uint64_t>, LatencyHistogramSnapshot::BUCKETS> buckets {};
+	};
+
+	/// Point in time statistics about a connection pool.
+	struct ConnectionPoolMetrics {
+		/// Connections handed out.
+		uint64_t checkouts {0};
+		/// Checkouts which timed out.
+		uint64_t timeouts {0};
+		/// Connections created.
+		uint64_t creates {0};
+		/// Connections closed (created, less those open).
+		uint64_t destroys {0};
+		/// Pings which failed, discarding the connection.
+		uint64_t pingFailures {0};
+		/// Connections currently checked out.
+		unsigned int inUse {0};
+		/// Connections currently idle in the pool.
+		unsigned int available {0};
+		/// Time spent waiting for a connection.
+		LatencyHistogramSnapshot checkoutWait;
+		/// Time between checkout and return to the pool.
+		LatencyHistogramSnapshot hold;
+		/// Time spent creating connections.
+		LatencyHistogramSnapshot create;
+		/// Time spent pinging connections.
+		LatencyHistogramSnapshot ping;
+	};
+}
+
+#endif
@@ -0,0 +1,185 @@
+#include "readWriteRouter.h"
+#include "error.h"
+#include "sqlParse.h"
+#include <utility>
+
+namespace DB {
+	ReadWriteRouter::ReadWriteRouter(BasicConnectionPool & p, BasicConnectionPool & r) :
+		ReadWriteRouter(
+				[&p]() {
+					return p.get();
+				},
+				[&r]() {
+					return r.get();
+				})
+	{
+	}
+
+	ReadWriteRouter::ReadWriteRouter(ConnectionSource p, ConnectionSource r) :
+		primarySource(std::move(p)), replicaSource(std::move(r))
+	{
+	}
+
+	Connection &
+	ReadWriteRouter::writer() const
+	{
+		if (!primaryConnection) {
+			primaryConnection.emplace(primarySource());
+		}
+		return *primaryConnection->get();
+	}
+
+	Connection &
+	ReadWriteRouter::primary()
+	{
+		stuck = true;
+		return writer();
+	}
+
+	Connection &
+	ReadWriteRouter::route(const std::string & sql)
+	{
+		if (!isReadOnlySql(sql)) {
+			return primary();
+		}
+		if (stuck || inTx()) {
+			return writer();
+		}
+		if (!replicaConnection) {
+			replicaConnection.emplace(replicaSource());
+		}
+		return *replicaConnection->get();
+	}
+
+	bool
+	ReadWriteRouter::sticky() const
+	{
+		return stuck;
+	}
+
+	void
+	ReadWriteRouter::ping() const
+	{
+		if (primaryConnection) {
+			(*primaryConnection)->ping();
+		}
+		if (replicaConnection) {
+			(*replicaConnection)->ping();
+		}
+	}
+
+	BulkDeleteStyle
+	ReadWriteRouter::bulkDeleteStyle() const
+	{
+		return writer().bulkDeleteStyle();
+	}
+
+	BulkUpdateStyle
+	ReadWriteRouter::bulkUpdateStyle() const
+	{
+		return writer().bulkUpdateStyle();
+	}
+
+	BulkUpsertStyle
+	ReadWriteRouter::bulkUpsertStyle() const
+	{
+		return writer().bulkUpsertStyle();
+	}
+
+	ReturningStyle
+	ReadWriteRouter::returningStyle() const
+	{
+		return writer().returningStyle();
+	}
+
+	void
+	ReadWriteRouter::execute(const std::string & sql, const CommandOptionsCPtr & opts)
+	{
+		interact([this, &sql, &opts]() {
+			route(sql).execute(sql, opts);
+		});
+	}
+
+	SelectCommandPtr
+	ReadWriteRouter::select(const std::string & sql, const CommandOptionsCPtr & opts)
+	{
+		return route(sql).select(sql, opts);
+	}
+
+	ModifyCommandPtr
+	ReadWriteRouter::modify(const std::string & sql, const CommandOptionsCPtr & opts)
+	{
+		return primary().modify(sql, opts);
+	}
+
+	void
+	ReadWriteRouter::beginBulkUpload(const char * table, const char * opts)
+	{
+		primary().beginBulkUpload(table, opts);
+	}
+
+	void
+	ReadWriteRouter::endBulkUpload(const char * msg)
+	{
+		writer().endBulkUpload(msg);
+	}
+
+	size_t
+	ReadWriteRouter::bulkUploadData(const char * data, size_t len) const
+	{
+		return writer().bulkUploadData(data, len);
+	}
+
+	void
+	ReadWriteRouter::beginBulkDownload(const char * source, const char * opts)
+	{
+		// A bare table name is read only too
+		auto & c = route(std::string("SELECT * FROM ") + source);
+		c.beginBulkDownload(source, opts);
+		downloading = &c;
+	}
+
+	void
+	ReadWriteRouter::endBulkDownload(const char * msg)
+	{
+		if (downloading) {
+			std::exchange(downloading, nullptr)->endBulkDownload(msg);
+		}
+	}
+
+	size_t
+	ReadWriteRouter::bulkDownloadData(const BulkDownloadSink & sink) const
+	{
+		if (!downloading) {
+			throw BulkDownloadNotSupported();
+		}
+		return downloading->bulkDownloadData(sink);
+	}
+
+	int64_t
+	ReadWriteRouter::insertId()
+	{
+		return primary().insertId();
+	}
+
+	void
+	ReadWriteRouter::beginTxInt()
+	{
+		// Routed to the primary by being in a transaction, not pinned to it
+		writer().beginTx();
+	}
+
+	void
+	ReadWriteRouter::commitTxInt()
+	{
+		writer().commitTx();
+		stuck = false;
+	}
+
+	void
+	ReadWriteRouter::rollbackTxInt()
+	{
+		stuck = false;
+		writer().rollbackTx();
+	}
+}
@@ -0,0 +1,79 @@
+#ifndef DB_READWRITEROUTER_H
+#define DB_READWRITEROUTER_H
+
+#include "connection.h"
+#include "connectionPool.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <visibility.h>
+
+namespace DB {
+	/// Source of connections, such as a pool's get.
+	using ConnectionSource = std::function<ConnectionHandle()>;
+
+	/// Connection which sends read only statements outside of transactions to a replica and everything else
+	/// to a primary. Connections are taken on first use and held for the router's lifetime. Once a write has
+	/// been sent to the primary, so is everything else until a transaction ends, so the session sees its own
+	/// writes. Statements are classified by isReadOnlySql; use primary() directly for reads with side effects.
+	class DLL_PUBLIC ReadWriteRouter : public Connection {
+	public:
+		/// Create a router over a primary pool and a replica pool.
+		ReadWriteRouter(BasicConnectionPool & primary, BasicConnectionPool & replica);
+		/// Create a router over connection sources for the primary and a replica.
+		ReadWriteRouter(ConnectionSource primary, ConnectionSource replica);
+
+		void ping() const override;
+		/// @cond
+		BulkDeleteStyle bulkDeleteStyle() const override;
+		BulkUpdateStyle bulkUpdateStyle() const override;
+		BulkUpsertStyle bulkUpsertStyle() const override;
+		ReturningStyle returningStyle() const override;
+		/// @endcond
+
+		void execute(const std::string & sql, const CommandOptionsCPtr & = nullptr) override;
+		SelectCommandPtr select(const std::string & sql, const CommandOptionsCPtr & = nullptr) override;
+		ModifyCommandPtr modify(const std::string & sql, const CommandOptionsCPtr & = nullptr) override;
+
+		void beginBulkUpload(const char * table, const char * opts) override;
+		void endBulkUpload(const char *) override;
+		size_t bulkUploadData(const char *, size_t) const override;
+		using Connection::bulkUploadData;
+
+		void beginBulkDownload(const char * source, const char * opts) override;
+		void endBulkDownload(const char *) override;
+		size_t bulkDownloadData(const BulkDownloadSink &) const override;
+		using Connection::bulkDownloadData;
+
+		int64_t insertId() override;
+
+		/// The connection used for writes, taking it if required. Pins the session to the primary until a
+		/// transaction ends.
+		Connection & primary();
+		/// The connection the given SQL would be sent to.
+		Connection & route(const std::string & sql);
+		/// Test whether the session is pinned to the primary.
+		[[nodiscard]] bool sticky() const;
+
+	protected:
+		/// @cond
+		void beginTxInt() override;
+		void commitTxInt() override;
+		void rollbackTxInt() override;
+		/// @endcond
+
+	private:
+		DLL_PRIVATE Connection & writer() const;
+
+		const ConnectionSource primarySource;
+		const ConnectionSource replicaSource;
+		mutable std::optional<ConnectionHandle> primaryConnection;
+		std::optional<ConnectionHandle> replicaConnection;
+		bool stuck {false};
+		Connection * downloading {nullptr};
+	};
+}
+
+#endif
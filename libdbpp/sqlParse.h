@@ -56,7 +56,23 @@ namespace DB {
 	private:
 		DB::Connection * const conn;
 	};
+
+	class DLL_PUBLIC SqlStatementClassifier : public SqlParse {
+	public:
+		explicit SqlStatementClassifier(std::istream &);
+
+		void Comment(const std::string &) const override;
+		void Statement(const std::string &) const override;
+
+		mutable bool readOnly {true};
+		mutable unsigned int statements {0};
+	};
 	/// @endcond
+
+	/// Test whether SQL (one or more statements) only reads data and so can be run on a read replica.
+	/// Statements are classified by their leading keyword; read statements (SELECT, WITH, etc) mentioning
+	/// a modifying or locking keyword anywhere are not read only.
+	DLL_PUBLIC bool isReadOnlySql(const std::string & sql);
 }
 
 #endif
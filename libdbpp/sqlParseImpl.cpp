@@ -1,7 +1,11 @@
 #include "connection.h"
 #include "sqlParse.h"
+#include <algorithm>
+#include <array>
+#include <cctype>
 #include <compileTimeFormatter.h>
 #include <filesystem>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <utility>
@@ -51,4 +55,81 @@ namespace DB {
 		conn->execute(text);
 	}
 
+	SqlStatementClassifier::SqlStatementClassifier(std::istream & f) : SqlParse(f, {}) { }
+
+	void
+	SqlStatementClassifier::Comment(const std::string &) const
+	{
+	}
+
+	namespace {
+		constexpr std::array<std::string_view, 6> READ_STATEMENTS {
+				"SELECT", "WITH", "SHOW", "EXPLAIN", "VALUES", "TABLE"};
+		// Make a read statement write or lock: data modifying CTEs, SELECT INTO, FOR UPDATE/SHARE
+		constexpr std::array<std::string_view, 7> WRITE_WORDS {
+				"INSERT", "UPDATE", "DELETE", "MERGE", "TRUNCATE", "INTO", "SHARE"};
+
+		bool
+		isWordChar(char c)
+		{
+			return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+		}
+
+		template<typename Fn>
+		bool
+		anyWord(const std::string & text, const Fn & fn)
+		{
+			for (auto i = text.begin(); i != text.end();) {
+				i = std::find_if(i, text.end(), isWordChar);
+				const auto e = std::find_if_not(i, text.end(), isWordChar);
+				std::string word(i, e);
+				std::transform(word.begin(), word.end(), word.begin(), [](unsigned char c) {
+					return static_cast<char>(std::toupper(c));
+				});
+				if (!word.empty() && fn(word)) {
+					return true;
+				}
+				i = e;
+			}
+			return false;
+		}
+
+		template<std::size_t N>
+		bool
+		contains(const std::array<std::string_view, N> & words, const std::string & word)
+		{
+			return std::find(words.begin(), words.end(), word) != words.end();
+		}
+	}
+
+	void
+	SqlStatementClassifier::Statement(const std::string & text) const
+	{
+		statements += 1;
+		bool leading = true;
+		const bool writes = anyWord(text, [&leading](const std::string & word) {
+			if (leading) {
+				leading = false;
+				return !contains(READ_STATEMENTS, word);
+			}
+			return contains(WRITE_WORDS, word);
+		});
+		readOnly = readOnly && !writes;
+	}
+
+	bool
+	isReadOnlySql(const std::string & sql)
+	{
+		// The lexer only completes terminated statements; the newline ends any trailing line comment
+		std::stringstream f(sql + "\n;");
+		SqlStatementClassifier c(f);
+		try {
+			c.Execute();
+		}
+		catch (const SqlParseException &) {
+			// Not understood, not assumed safe
+			return false;
+		}
+		return c.statements > 0 && c.readOnly;
+	}
 }
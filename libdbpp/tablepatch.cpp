@@ -1,14 +1,180 @@
 #include "tablepatch.h"
 #include "connection.h"
+#include "connectionPool.h"
 #include "modifycommand.h"
 #include "selectcommand.h" // IWYU pragma: keep
 #include "sqlWriter.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/format.hpp>
 #include <boost/format/format_fwd.hpp>
 #include <buffer.h>
+#include <column.h>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <numeric>
+#include <optional>
 #include <safeMapFind.h>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <utility>
+#include <variant>
+#include <vector>
+
+namespace {
+	using AuditFunction = std::function<void(DB::SelectCommandPtr)>;
+
+	std::atomic<unsigned int> materialisedCount;
+
+	// The patch source evaluated once into an indexed temporary table; swapped in as the source expression for
+	// the lifetime of this object.
+	class MaterialisedSource : public DB::StaticSqlWriter {
+	public:
+		MaterialisedSource(DB::Connection * c, DB::TablePatch * tp);
+		~MaterialisedSource() override;
+		SPECIAL_MEMBERS_COPY(MaterialisedSource, delete);
+		SPECIAL_MEMBERS_MOVE(MaterialisedSource, delete);
+
+		void drop();
+
+	private:
+		DB::Connection * c;
+		DB::TablePatch * tp;
+		DB::SqlWriter * const original;
+		bool dropped {false};
+	};
+
+	using KeyValue = DB::PatchValue;
+
+	// A range of values of the first primary key column, exclusive of lower, inclusive of upper.
+	struct KeyRange {
+		const KeyValue * lower;
+		const KeyValue * upper;
+	};
+
+	// Restricts the patch source and destination to a key range; swapped in as the source and where
+	// expressions for the lifetime of this object.
+	class KeyRangeRestriction {
+	public:
+		KeyRangeRestriction(DB::TablePatch * tp, const KeyRange & range);
+		~KeyRangeRestriction();
+		SPECIAL_MEMBERS_COPY(KeyRangeRestriction, delete);
+		SPECIAL_MEMBERS_MOVE(KeyRangeRestriction, delete);
+
+	private:
+		class Source : public DB::SqlWriter {
+		public:
+			explicit Source(const KeyRangeRestriction &);
+			void writeSql(AdHoc::Buffer & buffer) override;
+			void bindParams(DB::Command * cmd, unsigned int & offset) override;
+
+			const KeyRangeRestriction & r;
+		};
+		class Where : public DB::SqlWriter {
+		public:
+			explicit Where(const KeyRangeRestriction &);
+			void writeSql(AdHoc::Buffer & buffer) override;
+			void bindParams(DB::Command * cmd, unsigned int & offset) override;
+
+			const KeyRangeRestriction & r;
+		};
+
+		void writeRange(AdHoc::Buffer & buffer, const char * alias) const;
+		void bindRange(DB::Command * cmd, unsigned int & offset) const;
+
+		DB::TablePatch * tp;
+		const std::string & key;
+		const KeyRange range;
+		DB::SqlWriter * const originalSrc;
+		DB::SqlWriter * const originalWhere;
+		Source src;
+		Where where;
+	};
+
+	// Restricts the patch source to rows beyond the last watermark, up to the highest at the start of the patch,
+	// while active; swapped in as the source expression for the lifetime of this object.
+	class WatermarkRestriction : public DB::SqlWriter {
+	public:
+		WatermarkRestriction(DB::Connection * c, DB::TablePatch * tp);
+		~WatermarkRestriction() override;
+		SPECIAL_MEMBERS_COPY(WatermarkRestriction, delete);
+		SPECIAL_MEMBERS_MOVE(WatermarkRestriction, delete);
+
+		void writeSql(AdHoc::Buffer & buffer) override;
+		void bindParams(DB::Command * cmd, unsigned int & offset) override;
+
+		void advance();
+
+		bool active {false};
+
+	private:
+		DB::TablePatch * tp;
+		DB::SqlWriter * const original;
+		KeyValue upper;
+	};
+
+	// Passes through the rows of another (already bound) select, counting them as they're fetched.
+	class CountingSelect : public DB::SelectCommand {
+	public:
+		explicit CountingSelect(DB::SelectCommandPtr inner);
+
+		bool fetch() override;
+		void execute() override;
+
+		// NOLINTBEGIN(readability-inconsistent-declaration-parameter-name)
+		void bindParamI(unsigned int, int) override;
+		void bindParamI(unsigned int, long int) override;
+		void bindParamI(unsigned int, long long int) override;
+		void bindParamI(unsigned int, unsigned int) override;
+		void bindParamI(unsigned int, long unsigned int) override;
+		void bindParamI(unsigned int, long long unsigned int) override;
+		void bindParamB(unsigned int, bool) override;
+		void bindParamF(unsigned int, double) override;
+		void bindParamF(unsigned int, float) override;
+		void bindParamS(unsigned int, const Glib::ustring &) override;
+		void bindParamS(unsigned int, const std::string_view) override;
+		void bindParamT(unsigned int, const boost::posix_time::time_duration) override;
+		void bindParamT(unsigned int, const boost::posix_time::ptime) override;
+		void bindNull(unsigned int) override;
+		// NOLINTEND(readability-inconsistent-declaration-parameter-name)
+		using DB::Command::bindParamS;
+
+		const DB::SelectCommandPtr inner;
+		unsigned int rows {0};
+
+	private:
+		class Column : public DB::Column {
+		public:
+			explicit Column(const DB::Column & inner);
+
+			[[nodiscard]] bool isNull() const override;
+			void apply(DB::HandleField &) const override;
+
+		private:
+			const DB::Column & inner;
+		};
+	};
+
+	std::vector<KeyValue> chunkBoundaries(DB::Connection * c, DB::TablePatch * tp);
+	std::vector<KeyValue> partitionBoundaries(DB::Connection * c, DB::TablePatch * tp, unsigned int partitions);
+}
+
+static bool
+patchUpserting(DB::Connection * c, const DB::TablePatch * tp)
+{
+	// An upsert can't apply the where clause (which refers to both source and destination) to an ON CONFLICT update
+	return tp->upsert && tp->doUpdates && tp->doInserts
+			&& (c->bulkUpsertStyle() == DB::BulkUpsertStyle::Merge
+					|| (c->bulkUpsertStyle() == DB::BulkUpsertStyle::OnConflict && !tp->where));
+}
 
 DB::PatchResult
 DB::Connection::patchTable(TablePatch * tp)
@@ -16,17 +182,81 @@ DB::Connection::patchTable(TablePatch * tp)
 	if (tp->pk.empty()) {
 		throw PatchCheckFailure();
 	}
-	if (!inTx()) {
+	const bool commits = tp->chunkSize && tp->chunkBoundary == PatchChunkBoundary::Commit;
+	if (commits && inTx()) {
+		// Commits its own transactions, never the caller's
+		throw TransactionAlreadyOpen();
+	}
+	if (!commits && !inTx()) {
 		throw TransactionRequired();
 	}
-	TransactionScope tx(*this);
+	// Outlives the transaction, so a failed patch's table is dropped after rolling back, not in an aborted transaction
+	std::optional<MaterialisedSource> materialised;
+	std::optional<TransactionScope> tx;
+	tx.emplace(*this);
 	bool ownedExpr = false;
 	if (!tp->srcExpr && !tp->src.empty()) {
 		tp->srcExpr = new DB::StaticSqlWriter(tp->src);
 		ownedExpr = true;
 	}
-	DB::PatchResult r {tp->doDeletes ? patchDeletes(tp) : 0, tp->doUpdates ? patchUpdates(tp) : 0,
-			tp->doInserts ? patchInserts(tp) : 0};
+	if (tp->materialiseSrc) {
+		materialised.emplace(this, tp);
+	}
+	std::optional<WatermarkRestriction> watermark;
+	if (!tp->watermark.empty()) {
+		watermark.emplace(this, tp);
+	}
+	// Decided on the caller's where clause, before chunking adds its own; ON CONFLICT upserts are confined to a
+	// chunk by its restricted source
+	const auto upsert = patchUpserting(this, tp);
+	const auto phases = [this, tp, upsert, &watermark]() {
+		DB::PatchResult pr {};
+		pr.deletes = tp->doDeletes ? patchDeletes(tp) : 0;
+		// Deletes need the whole source, everything else only what's changed since the last watermark
+		if (watermark) {
+			watermark->active = true;
+		}
+		if (upsert) {
+			pr.upserts = patchUpserts(tp);
+		}
+		else {
+			pr.updates = tp->doUpdates ? patchUpdates(tp) : 0;
+			pr.inserts = tp->doInserts ? patchInserts(tp) : 0;
+		}
+		if (watermark) {
+			watermark->active = false;
+		}
+		return pr;
+	};
+	DB::PatchResult r {};
+	if (tp->chunkSize) {
+		const auto bounds = chunkBoundaries(this, tp);
+		for (size_t chunk = 0; chunk <= bounds.size(); chunk++) {
+			KeyRangeRestriction range(
+					tp, {chunk ? &bounds[chunk - 1] : nullptr, chunk < bounds.size() ? &bounds[chunk] : nullptr});
+			std::optional<TransactionScope> chunkTx;
+			if (tp->chunkBoundary == PatchChunkBoundary::Savepoint) {
+				chunkTx.emplace(*this);
+			}
+			r += phases();
+			chunkTx.reset();
+			if (commits) {
+				tx.reset();
+				tx.emplace(*this);
+			}
+		}
+	}
+	else {
+		r = phases();
+	}
+	if (watermark) {
+		watermark->advance();
+		watermark.reset();
+	}
+	if (materialised) {
+		materialised->drop();
+		materialised.reset();
+	}
 	if (ownedExpr) {
 		delete tp->srcExpr;
 		tp->srcExpr = nullptr;
@@ -34,6 +264,227 @@ DB::Connection::patchTable(TablePatch * tp)
 	return r;
 }
 
+// Up to n connections from the pool; at least one, then as many as are free
+static std::vector<DB::ConnectionHandle>
+patchConnections(DB::BasicConnectionPool & pool, std::size_t n)
+{
+	std::vector<DB::ConnectionHandle> conns;
+	conns.reserve(n);
+	while (conns.size() < n && (conns.empty() || pool.freeCount() > 0)) {
+		conns.emplace_back(pool.get());
+	}
+	return conns;
+}
+
+// Performs each of count work items on one of the connections (concurrently), each connection in its own
+// transaction; all are committed once every item has been performed, otherwise all are rolled back.
+static void
+patchConcurrently(std::vector<DB::ConnectionHandle> & conns, std::size_t count,
+		const std::function<void(DB::Connection *, std::size_t)> & work)
+{
+	for (auto c = conns.begin(); c != conns.end(); ++c) {
+		try {
+			(*c)->beginTx();
+		}
+		catch (...) {
+			DB::rollbackEach(conns.begin(), c);
+			throw;
+		}
+	}
+
+	std::vector<std::exception_ptr> errors(conns.size());
+	std::atomic<std::size_t> nextItem {0};
+	std::vector<std::thread> workers;
+	workers.reserve(conns.size());
+	try {
+		for (std::size_t w = 0; w < conns.size(); w++) {
+			workers.emplace_back([c = conns[w].get(), &error = errors[w], count, &work, &nextItem]() {
+				try {
+					for (std::size_t i; (i = nextItem++) < count;) {
+						work(c, i);
+					}
+				}
+				catch (...) {
+					error = std::current_exception();
+					nextItem = count;
+				}
+			});
+		}
+	}
+	catch (...) {
+		nextItem = count;
+		std::for_each(workers.begin(), workers.end(), std::mem_fn(&std::thread::join));
+		DB::rollbackEach(conns.begin(), conns.end());
+		throw;
+	}
+	std::for_each(workers.begin(), workers.end(), std::mem_fn(&std::thread::join));
+
+	auto c = conns.begin();
+	try {
+		if (const auto e = std::find_if(errors.begin(), errors.end(),
+					[](const auto & error) {
+						return static_cast<bool>(error);
+					});
+				e != errors.end()) {
+			std::rethrow_exception(*e);
+		}
+		for (; c != conns.end(); ++c) {
+			(*c)->commitTx();
+		}
+	}
+	catch (...) {
+		DB::rollbackEach(c, conns.end());
+		throw;
+	}
+}
+
+DB::PatchResult
+DB::parallelPatchTable(BasicConnectionPool & pool, const TablePatch & tp, unsigned int partitions)
+{
+	if (tp.pk.empty() || !tp.watermark.empty()) {
+		throw PatchCheckFailure();
+	}
+	const auto n = std::max(1U, partitions);
+	auto conns = patchConnections(pool, n);
+
+	DB::StaticSqlWriter srcTable(tp.src);
+	TablePatch whole = tp;
+	if (!whole.srcExpr) {
+		whole.srcExpr = &srcTable;
+	}
+	const auto bounds = partitionBoundaries(conns.front().get(), &whole, n);
+	std::vector<PatchResult> results(bounds.size() + 1);
+	patchConcurrently(conns, results.size(), [&whole, &bounds, &results](Connection * c, std::size_t p) {
+		TablePatch part = whole;
+		KeyRangeRestriction range(&part, {p ? &bounds[p - 1] : nullptr, p < bounds.size() ? &bounds[p] : nullptr});
+		results[p] = c->patchTable(&part);
+	});
+	PatchResult r {};
+	for (const auto & pr : results) {
+		r += pr;
+	}
+	return r;
+}
+
+// The patches (by index) in dependency order, those of referenced tables before those referencing them
+static std::vector<std::size_t>
+patchDependencyOrder(const std::vector<DB::TablePatch> & patches, const DB::PatchDependencies & deps)
+{
+	// Which patches must precede each patch
+	std::vector<std::vector<std::size_t>> preceding(patches.size());
+	for (const auto & [table, referenced] : deps) {
+		for (std::size_t i = 0; i < patches.size(); i++) {
+			for (std::size_t j = 0; j < patches.size(); j++) {
+				if (i != j && patches[i].dest == table && patches[j].dest == referenced) {
+					preceding[i].push_back(j);
+				}
+			}
+		}
+	}
+	std::vector<std::size_t> order;
+	std::vector<bool> ordered(patches.size());
+	const auto ready = [&preceding, &ordered](std::size_t i) {
+		return !ordered[i] && std::all_of(preceding[i].begin(), preceding[i].end(), [&ordered](auto p) {
+			return ordered[p];
+		});
+	};
+	while (order.size() < patches.size()) {
+		std::size_t next = 0;
+		while (next < patches.size() && !ready(next)) {
+			next++;
+		}
+		if (next == patches.size()) {
+			// Cyclic dependencies
+			throw DB::PatchCheckFailure();
+		}
+		order.push_back(next);
+		ordered[next] = true;
+	}
+	return order;
+}
+
+// Patches the given (dependency ordered) patches on one connection; deletes in reverse order, then updates and
+// inserts in order
+static void
+patchTablesInOrder(DB::Connection * c, std::vector<DB::TablePatch> & patches, const std::vector<std::size_t> & order,
+		std::vector<DB::TablePatchResult> & results)
+{
+	DB::TransactionScope tx(*c);
+	for (auto i = order.rbegin(); i != order.rend(); ++i) {
+		if (!patches[*i].doDeletes) {
+			continue;
+		}
+		DB::TablePatch deletes = patches[*i];
+		deletes.doUpdates = deletes.doInserts = false;
+		// The watermark doesn't restrict deletes; it's advanced by the updates and inserts
+		deletes.watermark.clear();
+		const auto start = std::chrono::steady_clock::now();
+		results[*i].result += c->patchTable(&deletes);
+		results[*i].deleteTime = std::chrono::steady_clock::now() - start;
+	}
+	for (const auto i : order) {
+		if (!patches[i].doUpdates && !patches[i].doInserts) {
+			continue;
+		}
+		DB::TablePatch writes = patches[i];
+		writes.doDeletes = false;
+		const auto start = std::chrono::steady_clock::now();
+		results[i].result += c->patchTable(&writes);
+		results[i].writeTime = std::chrono::steady_clock::now() - start;
+		patches[i].lastWatermark = writes.lastWatermark;
+	}
+}
+
+std::vector<DB::TablePatchResult>
+DB::patchTables(Connection & conn, std::vector<TablePatch> & patches, const PatchDependencies & deps)
+{
+	if (!conn.inTx()) {
+		throw TransactionRequired();
+	}
+	std::vector<TablePatchResult> results(patches.size());
+	patchTablesInOrder(&conn, patches, patchDependencyOrder(patches, deps), results);
+	return results;
+}
+
+std::vector<DB::TablePatchResult>
+DB::patchTables(BasicConnectionPool & pool, std::vector<TablePatch> & patches, const PatchDependencies & deps)
+{
+	// Group related patches together, each group keeping the dependency order
+	const auto order = patchDependencyOrder(patches, deps);
+	std::vector<std::size_t> group(patches.size());
+	std::iota(group.begin(), group.end(), 0);
+	const auto groupOf = [&group](std::size_t i) {
+		while (group[i] != i) {
+			i = group[i];
+		}
+		return i;
+	};
+	for (const auto & [table, referenced] : deps) {
+		for (std::size_t i = 0; i < patches.size(); i++) {
+			for (std::size_t j = 0; j < patches.size(); j++) {
+				if (patches[i].dest == table && patches[j].dest == referenced) {
+					group[groupOf(i)] = groupOf(j);
+				}
+			}
+		}
+	}
+	std::map<std::size_t, std::vector<std::size_t>> groupOrders;
+	for (const auto i : order) {
+		groupOrders[groupOf(i)].push_back(i);
+	}
+	std::vector<std::vector<std::size_t>> groups;
+	std::transform(groupOrders.begin(), groupOrders.end(), std::back_inserter(groups), [](auto & go) {
+		return std::move(go.second);
+	});
+
+	auto conns = patchConnections(pool, groups.size());
+	std::vector<TablePatchResult> results(patches.size());
+	patchConcurrently(conns, groups.size(), [&patches, &groups, &results](Connection * c, std::size_t g) {
+		patchTablesInOrder(c, patches, groups[g], results);
+	});
+	return results;
+}
+
 template<typename Container>
 static inline void
 push(const boost::format &, typename Container::const_iterator &)
@@ -93,6 +544,378 @@ self(const typename Container::const_iterator & i)
 		return !AdHoc::containerContains((tp)->pk, *i); \
 	}
 
+MaterialisedSource::MaterialisedSource(DB::Connection * c, DB::TablePatch * tp) :
+	DB::StaticSqlWriter("patchsrc_" + std::to_string(materialisedCount++)),
+	c(c), tp(tp), original(tp->srcExpr)
+{
+	auto srcCols = tp->cols;
+	srcCols.insert(tp->pk.begin(), tp->pk.end());
+	if (!tp->watermark.empty()) {
+		srcCols.insert(tp->watermark);
+	}
+	AdHoc::Buffer createSql;
+	createSql.appendbf("CREATE TEMPORARY TABLE %s AS SELECT ", sql);
+	append(createSql, srcCols, ", ", "b.%s", selfCols);
+	createSql.append(" FROM ");
+	tp->srcExpr->writeSql(createSql);
+	createSql.append(" b");
+	auto create = c->modify(createSql);
+	unsigned int offset = 0;
+	tp->srcExpr->bindParams(create.get(), offset);
+	create->execute(true);
+
+	AdHoc::Buffer indexSql;
+	indexSql.appendbf("CREATE INDEX %s_pk ON %s(", sql, sql);
+	append(indexSql, tp->pk, ", ", "%s", selfCols);
+	indexSql.append(")");
+	c->execute(indexSql);
+	tp->srcExpr = this;
+}
+
+MaterialisedSource::~MaterialisedSource()
+{
+	tp->srcExpr = original;
+	if (!dropped) {
+		try {
+			// Failed patch; rolled back already, which took the table too unless an earlier chunk committed it
+			c->execute("DROP TABLE IF EXISTS " + sql);
+		}
+		catch (...) {
+			// Gone with the session anyway
+		}
+	}
+}
+
+void
+MaterialisedSource::drop()
+{
+	dropped = true;
+	c->execute("DROP TABLE " + sql);
+}
+
+namespace {
+	class KeyCapture : public DB::HandleField {
+	public:
+		void
+		null() override
+		{
+			value = nullptr;
+		}
+		void
+		string(std::string_view v) override
+		{
+			value = std::string {v};
+		}
+		void
+		integer(int64_t v) override
+		{
+			value = v;
+		}
+		void
+		boolean(bool v) override
+		{
+			value = v;
+		}
+		void
+		floatingpoint(double v) override
+		{
+			value = v;
+		}
+		void
+		interval(const boost::posix_time::time_duration v) override
+		{
+			value = v;
+		}
+		void
+		timestamp(const boost::posix_time::ptime v) override
+		{
+			value = v;
+		}
+
+		KeyValue value;
+	};
+
+	// Selects (pick) from the distinct values of the first key column across both source and destination, numbered
+	// (patch_n) by the given window function.
+	std::vector<KeyValue>
+	keyBoundaries(DB::Connection * c, DB::TablePatch * tp, const std::string & pick, const std::string & numbering,
+			const std::string & filter)
+	{
+		const auto & key = *tp->pk.begin();
+		AdHoc::Buffer boundSql;
+		boundSql.appendbf("SELECT %s FROM (SELECT %s, %s OVER (ORDER BY %s) patch_n FROM (SELECT a.%s FROM %s a UNION "
+						  "SELECT b.%s FROM ",
+				pick, key, numbering, key, key, tp->dest, key);
+		tp->srcExpr->writeSql(boundSql);
+		boundSql.append(" b) patch_keys) patch_numbered ");
+		boundSql.append(filter);
+		boundSql.append(" ORDER BY 1");
+		auto bounds = c->select(boundSql);
+		unsigned int offset = 0;
+		tp->srcExpr->bindParams(bounds.get(), offset);
+		std::vector<KeyValue> values;
+		while (bounds->fetch()) {
+			KeyCapture capture;
+			(*bounds)[0].apply(capture);
+			values.emplace_back(std::move(capture.value));
+		}
+		return values;
+	}
+
+	std::vector<KeyValue>
+	chunkBoundaries(DB::Connection * c, DB::TablePatch * tp)
+	{
+		// Every chunkSize'th key
+		return keyBoundaries(c, tp, *tp->pk.begin(), "ROW_NUMBER()",
+				"WHERE patch_n % " + std::to_string(tp->chunkSize) + " = 0");
+	}
+
+	std::vector<KeyValue>
+	partitionBoundaries(DB::Connection * c, DB::TablePatch * tp, unsigned int partitions)
+	{
+		// The last key of each of (up to) partitions evenly sized groups; the last group is open ended
+		auto bounds = keyBoundaries(c, tp, "MAX(" + *tp->pk.begin() + ")",
+				"NTILE(" + std::to_string(partitions) + ")", "GROUP BY patch_n");
+		if (!bounds.empty()) {
+			bounds.pop_back();
+		}
+		return bounds;
+	}
+}
+
+CountingSelect::CountingSelect(DB::SelectCommandPtr i) :
+	DB::Command(i->sql), DB::SelectCommand(i->sql), inner(std::move(i))
+{
+}
+
+bool
+CountingSelect::fetch()
+{
+	if (!inner->fetch()) {
+		return false;
+	}
+	if (!columnCount()) {
+		for (unsigned int c = 0; c < inner->columnCount(); c++) {
+			insertColumn(std::make_unique<Column>((*inner)[c]));
+		}
+	}
+	rows += 1;
+	return true;
+}
+
+void
+CountingSelect::execute()
+{
+	inner->execute();
+}
+
+#define PASSTHROUGH_BIND(func, type) \
+	void CountingSelect::func(unsigned int i, type v) \
+	{ \
+		inner->func(i, v); \
+	}
+PASSTHROUGH_BIND(bindParamI, int)
+PASSTHROUGH_BIND(bindParamI, long int)
+PASSTHROUGH_BIND(bindParamI, long long int)
+PASSTHROUGH_BIND(bindParamI, unsigned int)
+PASSTHROUGH_BIND(bindParamI, long unsigned int)
+PASSTHROUGH_BIND(bindParamI, long long unsigned int)
+PASSTHROUGH_BIND(bindParamB, bool)
+PASSTHROUGH_BIND(bindParamF, double)
+PASSTHROUGH_BIND(bindParamF, float)
+PASSTHROUGH_BIND(bindParamS, const Glib::ustring &)
+PASSTHROUGH_BIND(bindParamS, const std::string_view)
+PASSTHROUGH_BIND(bindParamT, const boost::posix_time::time_duration)
+PASSTHROUGH_BIND(bindParamT, const boost::posix_time::ptime)
+#undef PASSTHROUGH_BIND
+
+void
+CountingSelect::bindNull(unsigned int i)
+{
+	inner->bindNull(i);
+}
+
+CountingSelect::Column::Column(const DB::Column & c) : DB::Column(c.name, c.colNo), inner(c) { }
+
+bool
+CountingSelect::Column::isNull() const
+{
+	return inner.isNull();
+}
+
+void
+CountingSelect::Column::apply(DB::HandleField & h) const
+{
+	inner.apply(h);
+}
+
+static unsigned int
+patchAudited(const DB::SelectCommandPtr & sel, const AuditFunction & audit)
+{
+	auto counted = std::make_shared<CountingSelect>(sel);
+	audit(counted);
+	// Whatever the audit didn't look at was still affected
+	while (counted->fetch()) { }
+	return counted->rows;
+}
+
+KeyRangeRestriction::KeyRangeRestriction(DB::TablePatch * tp, const KeyRange & range) :
+	tp(tp), key(*tp->pk.begin()), range(range), originalSrc(tp->srcExpr), originalWhere(tp->where), src(*this),
+	where(*this)
+{
+	tp->srcExpr = &src;
+	tp->where = &where;
+}
+
+KeyRangeRestriction::~KeyRangeRestriction()
+{
+	tp->srcExpr = originalSrc;
+	tp->where = originalWhere;
+}
+
+void
+KeyRangeRestriction::writeRange(AdHoc::Buffer & buffer, const char * alias) const
+{
+	if (range.lower) {
+		buffer.appendbf("%s.%s > ?", alias, key);
+	}
+	if (range.lower && range.upper) {
+		buffer.append(" AND ");
+	}
+	if (range.upper) {
+		buffer.appendbf("%s.%s <= ?", alias, key);
+	}
+	if (!range.lower && !range.upper) {
+		buffer.append("1 = 1");
+	}
+}
+
+void
+KeyRangeRestriction::bindRange(DB::Command * cmd, unsigned int & offset) const
+{
+	for (const auto bound : {range.lower, range.upper}) {
+		if (bound) {
+			std::visit(
+					[cmd, &offset](const auto & v) {
+						cmd->bindParam(offset++, v);
+					},
+					*bound);
+		}
+	}
+}
+
+KeyRangeRestriction::Source::Source(const KeyRangeRestriction & r) : r(r) { }
+
+void
+KeyRangeRestriction::Source::writeSql(AdHoc::Buffer & buffer)
+{
+	buffer.append("(SELECT * FROM ");
+	r.originalSrc->writeSql(buffer);
+	buffer.append(" r WHERE ");
+	r.writeRange(buffer, "r");
+	buffer.append(")");
+}
+
+void
+KeyRangeRestriction::Source::bindParams(DB::Command * cmd, unsigned int & offset)
+{
+	r.originalSrc->bindParams(cmd, offset);
+	r.bindRange(cmd, offset);
+}
+
+KeyRangeRestriction::Where::Where(const KeyRangeRestriction & r) : r(r) { }
+
+void
+KeyRangeRestriction::Where::writeSql(AdHoc::Buffer & buffer)
+{
+	r.writeRange(buffer, "a");
+	if (r.originalWhere) {
+		buffer.append(" AND ");
+		r.originalWhere->writeSql(buffer);
+	}
+}
+
+void
+KeyRangeRestriction::Where::bindParams(DB::Command * cmd, unsigned int & offset)
+{
+	r.bindRange(cmd, offset);
+	if (r.originalWhere) {
+		r.originalWhere->bindParams(cmd, offset);
+	}
+}
+
+WatermarkRestriction::WatermarkRestriction(DB::Connection * c, DB::TablePatch * tp) :
+	tp(tp), original(tp->srcExpr)
+{
+	AdHoc::Buffer maxSql;
+	maxSql.appendbf("SELECT MAX(b.%s) FROM ", tp->watermark);
+	original->writeSql(maxSql);
+	maxSql.append(" b");
+	auto max = c->select(maxSql);
+	unsigned int offset = 0;
+	original->bindParams(max.get(), offset);
+	while (max->fetch()) {
+		KeyCapture capture;
+		(*max)[0].apply(capture);
+		upper = std::move(capture.value);
+	}
+	tp->srcExpr = this;
+}
+
+WatermarkRestriction::~WatermarkRestriction()
+{
+	tp->srcExpr = original;
+}
+
+void
+WatermarkRestriction::advance()
+{
+	if (!std::holds_alternative<std::nullptr_t>(upper)) {
+		tp->lastWatermark = upper;
+	}
+}
+
+void
+WatermarkRestriction::writeSql(AdHoc::Buffer & buffer)
+{
+	if (!active) {
+		original->writeSql(buffer);
+		return;
+	}
+	buffer.append("(SELECT * FROM ");
+	original->writeSql(buffer);
+	buffer.append(" r WHERE ");
+	if (std::holds_alternative<std::nullptr_t>(upper)) {
+		// No watermarked rows at all
+		buffer.append("1 = 0");
+	}
+	else {
+		if (!std::holds_alternative<std::nullptr_t>(tp->lastWatermark)) {
+			buffer.appendbf("r.%s > ? AND ", tp->watermark);
+		}
+		buffer.appendbf("r.%s <= ?", tp->watermark);
+	}
+	buffer.append(")");
+}
+
+void
+WatermarkRestriction::bindParams(DB::Command * cmd, unsigned int & offset)
+{
+	original->bindParams(cmd, offset);
+	if (!active || std::holds_alternative<std::nullptr_t>(upper)) {
+		return;
+	}
+	for (const auto * bound : {&tp->lastWatermark, &upper}) {
+		std::visit(
+				[cmd, &offset](const auto & v) {
+					if constexpr (!std::is_same_v<std::decay_t<decltype(v)>, std::nullptr_t>) {
+						cmd->bindParam(offset++, v);
+					}
+				},
+				*bound);
+	}
+}
+
 static void
 patchDeletesSelect(AdHoc::Buffer & toDelSql, DB::TablePatch * tp)
 {
@@ -108,32 +931,77 @@ patchDeletesSelect(AdHoc::Buffer & toDelSql, DB::TablePatch * tp)
 	}
 }
 
-unsigned int
-DB::Connection::patchDeletes(TablePatch * tp)
+struct DB::PatchStep {
+	// The statement, and the writers whose parameters it binds (in order)
+	std::string sql;
+	std::vector<SqlWriter *> binds;
+	// When set, the statement is a select whose rows are given to this audit, otherwise it's a modification
+	AuditFunction audit;
+	// Whether the rows affected (or selected) are the result of the phase
+	bool counts {true};
+	// The modification, once prepared
+	ModifyCommandPtr prepared;
+};
+
+static unsigned int
+patchRun(DB::Connection * c, DB::PatchSteps & steps)
 {
-	if (tp->beforeDelete) {
-		AdHoc::Buffer toDelSql;
-		toDelSql.append("SELECT ");
-		append(toDelSql, tp->cols, ", ", "a.%s", selfCols);
-		toDelSql.appendbf(" FROM %s a LEFT OUTER JOIN ", tp->dest);
-		tp->srcExpr->writeSql(toDelSql);
-		toDelSql.append(" b ON ");
-		append(toDelSql, tp->pk, " AND ", " a.%s = b.%s", selfCols, selfCols);
-		patchDeletesSelect(toDelSql, tp);
-		auto del = select(toDelSql);
-		unsigned int offset = 0;
-		tp->srcExpr->bindParams(del.get(), offset);
-		if (tp->where) {
-			tp->where->bindParams(del.get(), offset);
+	unsigned int affected = 0;
+	for (auto & step : steps) {
+		const auto bind = [&step](DB::Command * cmd) {
+			unsigned int offset = 0;
+			for (const auto & writer : step.binds) {
+				if (writer) {
+					writer->bindParams(cmd, offset);
+				}
+			}
+		};
+		if (step.audit) {
+			auto sel = c->select(step.sql);
+			bind(sel.get());
+			if (step.counts) {
+				affected += patchAudited(sel, step.audit);
+			}
+			else {
+				step.audit(sel);
+			}
+			continue;
 		}
-		if (tp->order) {
-			tp->order->bindParams(del.get(), offset);
+		if (!step.prepared) {
+			step.prepared = c->modify(step.sql);
 		}
-		tp->beforeDelete(del);
+		bind(step.prepared.get());
+		affected += step.prepared->execute();
 	}
+	return affected;
+}
+
+static DB::PatchStep
+patchDeletesAudit(DB::TablePatch * tp, const AuditFunction & audit)
+{
 	AdHoc::Buffer toDelSql;
-	switch (bulkDeleteStyle()) {
-		case BulkDeleteStyle::UsingSubSelect: {
+	toDelSql.append("SELECT ");
+	append(toDelSql, tp->cols, ", ", "a.%s", selfCols);
+	toDelSql.appendbf(" FROM %s a LEFT OUTER JOIN ", tp->dest);
+	tp->srcExpr->writeSql(toDelSql);
+	toDelSql.append(" b ON ");
+	append(toDelSql, tp->pk, " AND ", " a.%s = b.%s", selfCols, selfCols);
+	patchDeletesSelect(toDelSql, tp);
+	return {toDelSql, {tp->srcExpr, tp->where, tp->order}, audit, false, {}};
+}
+
+static DB::PatchSteps
+patchDeletesSteps(DB::Connection * c, DB::TablePatch * tp)
+{
+	DB::PatchSteps steps;
+	if (tp->beforeDelete) {
+		steps.emplace_back(patchDeletesAudit(tp, tp->beforeDelete));
+	}
+	// Deleted rows can't be selected afterwards, so they're only audited where the delete returns them
+	const auto returning = tp->afterDelete && c->returningStyle() == DB::ReturningStyle::Returning;
+	AdHoc::Buffer toDelSql;
+	switch (c->bulkDeleteStyle()) {
+		case DB::BulkDeleteStyle::UsingSubSelect: {
 			// -----------------------------------------------------------------
 			// Build SQL to delete keys ----------------------------------------
 			// -----------------------------------------------------------------
@@ -164,14 +1032,14 @@ DB::Connection::patchDeletes(TablePatch * tp)
 			toDelSql.append(")");
 			break;
 		}
-		case BulkDeleteStyle::UsingUsingAlias:
-		case BulkDeleteStyle::UsingUsing: {
+		case DB::BulkDeleteStyle::UsingUsingAlias:
+		case DB::BulkDeleteStyle::UsingUsing: {
 			if (tp->insteadOfDelete) {
 				toDelSql.appendbf("UPDATE %s a ", tp->dest);
 			}
 			else {
 				toDelSql.appendbf("DELETE FROM %s USING %s a ",
-						(bulkDeleteStyle() == BulkDeleteStyle::UsingUsingAlias ? "a" : tp->dest), tp->dest);
+						(c->bulkDeleteStyle() == DB::BulkDeleteStyle::UsingUsingAlias ? "a" : tp->dest), tp->dest);
 			}
 			toDelSql.append(" LEFT OUTER JOIN ");
 			tp->srcExpr->writeSql(toDelSql);
@@ -184,19 +1052,54 @@ DB::Connection::patchDeletes(TablePatch * tp)
 			break;
 		}
 	}
-	auto del = modify(toDelSql);
-	unsigned int offset = 0;
-	tp->srcExpr->bindParams(del.get(), offset);
-	if (tp->insteadOfDelete) {
-		tp->insteadOfDelete->bindParams(del.get(), offset);
-	}
-	if (tp->where) {
-		tp->where->bindParams(del.get(), offset);
+	if (returning) {
+		// The target table is only known by its name when deleted from directly, otherwise it's aliased
+		const auto deleted = c->bulkDeleteStyle() == DB::BulkDeleteStyle::UsingSubSelect
+						|| (c->bulkDeleteStyle() == DB::BulkDeleteStyle::UsingUsing && !tp->insteadOfDelete)
+				? tp->dest
+				: "a";
+		toDelSql.append(" RETURNING ");
+		append(
+				toDelSql, tp->cols, ", ", "%s.%s",
+				[&deleted](auto) {
+					return deleted;
+				},
+				selfCols);
 	}
-	if (tp->order) {
-		tp->order->bindParams(del.get(), offset);
+	steps.push_back({toDelSql, {tp->srcExpr, tp->insteadOfDelete, tp->where, tp->order},
+			returning ? tp->afterDelete : AuditFunction {}, true, {}});
+	return steps;
+}
+
+unsigned int
+DB::Connection::patchDeletes(TablePatch * tp)
+{
+	auto steps = patchDeletesSteps(this, tp);
+	return patchRun(this, steps);
+}
+
+static std::string
+rowHash(DB::TablePatch * tp, const std::string & alias)
+{
+	return (AdHoc::Buffer::getFormat(tp->rowHash) % alias).str();
+}
+
+static void
+patchChanged(AdHoc::Buffer & buf, DB::TablePatch * tp, const std::string & a, const std::string & b)
+{
+	// Verification compares the columns alone; also comparing hashes would only add updates of rows whose
+	// (stale) hash differs while every column matches
+	if (!tp->rowHash.empty() && !tp->verifyRowHash) {
+		const auto ha = rowHash(tp, a), hb = rowHash(tp, b);
+		buf.appendbf(" (((CASE WHEN (%s IS NULL AND %s IS NULL) THEN 1 ELSE 0 END) + (CASE WHEN(%s = %s) THEN 1 ELSE 0 "
+					 "END)) = 0)",
+				ha, hb, ha, hb);
+		return;
 	}
-	return del->execute();
+	appendIf(buf, tp->cols, isNotKey(tp), " OR ",
+			" (((CASE WHEN (" + a + ".%1% IS NULL AND " + b + ".%1% IS NULL) THEN 1 ELSE 0 END) + (CASE WHEN(" + a
+					+ ".%1% = " + b + ".%1%) THEN 1 ELSE 0 END)) = 0)",
+			selfCols);
 }
 
 static void
@@ -205,9 +1108,7 @@ patchUpdatesSelect(AdHoc::Buffer & updSql, DB::TablePatch * tp)
 	updSql.append(" WHERE ");
 	append(updSql, tp->pk, " AND ", " a.%s = b.%s ", selfCols, selfCols);
 	updSql.append(" AND (");
-	appendIf(updSql, tp->cols, isNotKey(tp), " OR ", " (((CASE WHEN (a.%s IS NULL AND b.%s IS NULL) THEN 1 ELSE 0 END) \
-			+ (CASE WHEN(a.%s = b.%s) THEN 1 ELSE 0 END)) = 0)",
-			selfCols, selfCols, selfCols, selfCols);
+	patchChanged(updSql, tp, "a", "b");
 	updSql.append(")");
 	if (tp->where) {
 		updSql.append(" AND ");
@@ -215,40 +1116,41 @@ patchUpdatesSelect(AdHoc::Buffer & updSql, DB::TablePatch * tp)
 	}
 }
 
-unsigned int
-DB::Connection::patchUpdates(TablePatch * tp)
+static DB::PatchStep
+patchUpdatesAudit(DB::TablePatch * tp, const AuditFunction & audit)
 {
+	AdHoc::Buffer updSql;
+	updSql.append("SELECT ");
+	append(updSql, tp->pk, ", ", "a.%s", selfCols);
+	appendIf(updSql, tp->cols, isNotKey(tp), "", ", a.%1% old_%1%", selfCols);
+	appendIf(updSql, tp->cols, isNotKey(tp), "", ", b.%1% new_%1%", selfCols);
+	updSql.appendbf(" FROM %s a, ", tp->dest);
+	tp->srcExpr->writeSql(updSql);
+	updSql.append(" b ");
+	patchUpdatesSelect(updSql, tp);
+	if (tp->order) {
+		updSql.append(" ORDER BY ");
+		tp->order->writeSql(updSql);
+	}
+	return {updSql, {tp->srcExpr, tp->where, tp->order}, audit, false, {}};
+}
+
+static DB::PatchSteps
+patchUpdatesSteps(DB::Connection * c, DB::TablePatch * tp)
+{
+	DB::PatchSteps steps;
 	if (tp->cols.size() == tp->pk.size()) {
 		// Can't "change" anything... it's all part of the key
-		return 0;
+		return steps;
 	}
 	if (tp->beforeUpdate) {
-		AdHoc::Buffer updSql;
-		updSql.append("SELECT ");
-		append(updSql, tp->pk, ", ", "a.%s", selfCols);
-		appendIf(updSql, tp->cols, isNotKey(tp), "", ", a.%1% old_%1%", selfCols);
-		appendIf(updSql, tp->cols, isNotKey(tp), "", ", b.%1% new_%1%", selfCols);
-		updSql.appendbf(" FROM %s a, ", tp->dest);
-		tp->srcExpr->writeSql(updSql);
-		updSql.append(" b ");
-		patchUpdatesSelect(updSql, tp);
-		if (tp->order) {
-			updSql.append(" ORDER BY ");
-			tp->order->writeSql(updSql);
-		}
-		auto upd = select(updSql);
-		unsigned int offset = 0;
-		tp->srcExpr->bindParams(upd.get(), offset);
-		if (tp->where) {
-			tp->where->bindParams(upd.get(), offset);
-		}
-		if (tp->order) {
-			tp->order->bindParams(upd.get(), offset);
-		}
-		tp->beforeUpdate(upd);
+		steps.emplace_back(patchUpdatesAudit(tp, tp->beforeUpdate));
 	}
-	switch (bulkUpdateStyle()) {
-		case BulkUpdateStyle::UsingFromSrc: {
+	// Updated rows can't be told from unchanged ones afterwards, so are only audited where the update returns them
+	const auto returning = tp->afterUpdate && c->returningStyle() == DB::ReturningStyle::Returning
+			&& c->bulkUpdateStyle() == DB::BulkUpdateStyle::UsingFromSrc;
+	switch (c->bulkUpdateStyle()) {
+		case DB::BulkUpdateStyle::UsingFromSrc: {
 			// -----------------------------------------------------------------
 			// Build SQL for list of updates to perform ------------------------
 			// -----------------------------------------------------------------
@@ -259,18 +1161,14 @@ DB::Connection::patchUpdates(TablePatch * tp)
 			tp->srcExpr->writeSql(updSql);
 			updSql.append(" b ");
 			patchUpdatesSelect(updSql, tp);
-			// -----------------------------------------------------------------
-			// Execute the bulk update command ---------------------------------
-			// -----------------------------------------------------------------
-			auto upd = modify(updSql);
-			unsigned int offset = 0;
-			tp->srcExpr->bindParams(upd.get(), offset);
-			if (tp->where) {
-				tp->where->bindParams(upd.get(), offset);
+			if (returning) {
+				updSql.append(" RETURNING ");
+				append(updSql, tp->cols, ", ", "a.%s", selfCols);
 			}
-			return upd->execute(true);
+			steps.push_back(
+					{updSql, {tp->srcExpr, tp->where}, returning ? tp->afterUpdate : AuditFunction {}, true, {}});
 		} break;
-		case BulkUpdateStyle::UsingJoin: {
+		case DB::BulkUpdateStyle::UsingJoin: {
 			// -----------------------------------------------------------------
 			// Build SQL for list of updates to perform ------------------------
 			// -----------------------------------------------------------------
@@ -284,21 +1182,17 @@ DB::Connection::patchUpdates(TablePatch * tp)
 				updSql.append(" ORDER BY ");
 				tp->order->writeSql(updSql);
 			}
-			// -----------------------------------------------------------------
-			// Execute the bulk update command ---------------------------------
-			// -----------------------------------------------------------------
-			auto upd = modify(updSql);
-			unsigned int offset = 0;
-			if (tp->where) {
-				tp->where->bindParams(upd.get(), offset);
-			}
-			if (tp->order) {
-				tp->order->bindParams(upd.get(), offset);
-			}
-			return upd->execute(true);
-		}
+			steps.push_back({updSql, {tp->where, tp->order}, {}, true, {}});
+		} break;
 	}
-	return 0;
+	return steps;
+}
+
+unsigned int
+DB::Connection::patchUpdates(TablePatch * tp)
+{
+	auto steps = patchUpdatesSteps(this, tp);
+	return patchRun(this, steps);
 }
 
 static void
@@ -318,20 +1212,23 @@ patchInsertsSelect(AdHoc::Buffer & toInsSql, DB::TablePatch * tp)
 	}
 }
 
-unsigned int
-DB::Connection::patchInserts(TablePatch * tp)
+static DB::PatchStep
+patchInsertsAudit(DB::TablePatch * tp, const AuditFunction & audit)
 {
+	AdHoc::Buffer toInsSql;
+	patchInsertsSelect(toInsSql, tp);
+	return {toInsSql, {tp->srcExpr, tp->order}, audit, false, {}};
+}
+
+static DB::PatchSteps
+patchInsertsSteps(DB::Connection * c, DB::TablePatch * tp)
+{
+	DB::PatchSteps steps;
 	if (tp->beforeInsert) {
-		AdHoc::Buffer toInsSql;
-		patchInsertsSelect(toInsSql, tp);
-		auto ins = select(toInsSql);
-		unsigned int offset = 0;
-		tp->srcExpr->bindParams(ins.get(), offset);
-		if (tp->order) {
-			tp->order->bindParams(ins.get(), offset);
-		}
-		tp->beforeInsert(ins);
+		steps.emplace_back(patchInsertsAudit(tp, tp->beforeInsert));
 	}
+	// Inserted rows can't be told from existing ones afterwards, so are only audited where the insert returns them
+	const auto returning = tp->afterInsert && c->returningStyle() == DB::ReturningStyle::Returning;
 	// -----------------------------------------------------------------
 	// Build SQL for copying new records -------------------------------
 	// -----------------------------------------------------------------
@@ -340,13 +1237,144 @@ DB::Connection::patchInserts(TablePatch * tp)
 	append(toInsSql, tp->cols, ", ", "%s", selfCols);
 	toInsSql.append(")\n");
 	patchInsertsSelect(toInsSql, tp);
-	auto ins = modify(toInsSql);
-	unsigned int offset = 0;
-	tp->srcExpr->bindParams(ins.get(), offset);
-	if (tp->order) {
-		tp->order->bindParams(ins.get(), offset);
+	if (returning) {
+		toInsSql.append(" RETURNING ");
+		append(toInsSql, tp->cols, ", ", "%s", selfCols);
+	}
+	steps.push_back({toInsSql, {tp->srcExpr, tp->order}, returning ? tp->afterInsert : AuditFunction {}, true, {}});
+	return steps;
+}
+
+unsigned int
+DB::Connection::patchInserts(TablePatch * tp)
+{
+	auto steps = patchInsertsSteps(this, tp);
+	return patchRun(this, steps);
+}
+
+static DB::PatchSteps
+patchUpsertsSteps(DB::Connection * c, DB::TablePatch * tp)
+{
+	DB::PatchSteps steps;
+	// Updated and inserted rows can't be told apart in what an upsert returns, so there are no after audits
+	if (tp->cols.size() != tp->pk.size() && tp->beforeUpdate) {
+		steps.emplace_back(patchUpdatesAudit(tp, tp->beforeUpdate));
+	}
+	if (tp->beforeInsert) {
+		steps.emplace_back(patchInsertsAudit(tp, tp->beforeInsert));
+	}
+	AdHoc::Buffer upsSql;
+	switch (c->bulkUpsertStyle()) {
+		case DB::BulkUpsertStyle::OnConflict: {
+			// -----------------------------------------------------------------
+			// Build SQL to insert everything, updating on key conflict --------
+			// -----------------------------------------------------------------
+			upsSql.appendbf("INSERT INTO %s AS a(", tp->dest);
+			append(upsSql, tp->cols, ", ", "%s", selfCols);
+			upsSql.append(") SELECT ");
+			append(upsSql, tp->cols, ", ", "b.%s", selfCols);
+			upsSql.append(" FROM ");
+			tp->srcExpr->writeSql(upsSql);
+			// A where clause keeps ON CONFLICT from being parsed as part of a join
+			upsSql.append(" b WHERE 1 = 1");
+			if (tp->order) {
+				upsSql.append(" ORDER BY ");
+				tp->order->writeSql(upsSql);
+			}
+			upsSql.append(" ON CONFLICT (");
+			append(upsSql, tp->pk, ", ", "%s", selfCols);
+			if (tp->cols.size() == tp->pk.size()) {
+				upsSql.append(") DO NOTHING");
+			}
+			else {
+				upsSql.append(") DO UPDATE SET ");
+				appendIf(upsSql, tp->cols, isNotKey(tp), ", ", "%1% = EXCLUDED.%1%", selfCols);
+				upsSql.append(" WHERE ");
+				patchChanged(upsSql, tp, "a", "EXCLUDED");
+			}
+			steps.push_back({upsSql, {tp->srcExpr, tp->order}, {}, true, {}});
+		} break;
+		case DB::BulkUpsertStyle::Merge: {
+			// -----------------------------------------------------------------
+			// Build SQL to merge the source into the destination --------------
+			// -----------------------------------------------------------------
+			upsSql.appendbf("MERGE INTO %s a USING ", tp->dest);
+			tp->srcExpr->writeSql(upsSql);
+			upsSql.append(" b ON ");
+			append(upsSql, tp->pk, " AND ", " a.%s = b.%s", selfCols, selfCols);
+			if (tp->cols.size() != tp->pk.size()) {
+				upsSql.append(" WHEN MATCHED AND (");
+				patchChanged(upsSql, tp, "a", "b");
+				upsSql.append(")");
+				if (tp->where) {
+					upsSql.append(" AND ");
+					tp->where->writeSql(upsSql);
+				}
+				upsSql.append(" THEN UPDATE SET ");
+				appendIf(upsSql, tp->cols, isNotKey(tp), ", ", "%1% = b.%1%", selfCols);
+			}
+			upsSql.append(" WHEN NOT MATCHED THEN INSERT(");
+			append(upsSql, tp->cols, ", ", "%s", selfCols);
+			upsSql.append(") VALUES(");
+			append(upsSql, tp->cols, ", ", "b.%s", selfCols);
+			upsSql.append(")");
+			steps.push_back(
+					{upsSql, {tp->srcExpr, tp->cols.size() != tp->pk.size() ? tp->where : nullptr}, {}, true, {}});
+		} break;
+		case DB::BulkUpsertStyle::None:
+			break;
 	}
-	return ins->execute();
+	return steps;
+}
+
+unsigned int
+DB::Connection::patchUpserts(TablePatch * tp)
+{
+	auto steps = patchUpsertsSteps(this, tp);
+	return patchRun(this, steps);
+}
+
+DB::PreparedTablePatch::PreparedTablePatch(Connection & c, const TablePatch & tp) : conn(c)
+{
+	if (tp.pk.empty() || tp.materialiseSrc || tp.chunkSize || !tp.watermark.empty()) {
+		throw PatchCheckFailure();
+	}
+	TablePatch p = tp;
+	if (!p.srcExpr) {
+		src = std::make_unique<StaticSqlWriter>(p.src);
+		p.srcExpr = src.get();
+	}
+	if (p.doDeletes) {
+		deletes = patchDeletesSteps(&conn, &p);
+	}
+	if (patchUpserting(&conn, &p)) {
+		upserts = patchUpsertsSteps(&conn, &p);
+	}
+	else {
+		if (p.doUpdates) {
+			updates = patchUpdatesSteps(&conn, &p);
+		}
+		if (p.doInserts) {
+			inserts = patchInsertsSteps(&conn, &p);
+		}
+	}
+}
+
+DB::PreparedTablePatch::~PreparedTablePatch() = default;
+
+DB::PatchResult
+DB::PreparedTablePatch::execute()
+{
+	if (!conn.inTx()) {
+		throw TransactionRequired();
+	}
+	TransactionScope tx(conn);
+	PatchResult r {};
+	r.deletes = patchRun(&conn, deletes);
+	r.updates = patchRun(&conn, updates);
+	r.inserts = patchRun(&conn, inserts);
+	r.upserts = patchRun(&conn, upserts);
+	return r;
 }
 
 std::string
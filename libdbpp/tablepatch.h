@@ -2,13 +2,42 @@
 #define TABLEPATCH_H
 
 #include "command_fwd.h"
+#include "connection.h"
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <c++11Helpers.h>
+#include <chrono>
+#include <cstdint>
 #include <functional>
+#include <map>
+#include <memory>
 #include <set>
 #include <string>
+#include <variant>
+#include <vector>
 #include <visibility.h>
 
 namespace DB {
+	class BasicConnectionPool;
 	class SqlWriter;
+	/// @cond
+	struct PatchStep;
+	using PatchSteps = std::vector<PatchStep>;
+	/// @endcond
+
+	/// A single value read from or bound to a patch statement (e.g. a watermark).
+	using PatchValue = std::variant<std::nullptr_t, int64_t, double, bool, std::string,
+			boost::posix_time::time_duration, boost::posix_time::ptime>;
+
+	/// What separates the chunks of a chunked table patch.
+	enum class PatchChunkBoundary {
+		/// Nothing, all chunks are part of the patch's own transaction.
+		None,
+		/// Each chunk is patched within its own savepoint.
+		Savepoint,
+		/// Each chunk is committed in a transaction of its own. The patch must then be started outside of any
+		/// transaction (throws TransactionAlreadyOpen otherwise).
+		Commit,
+	};
 
 	/// Table patch settings.
 	class DLL_PUBLIC TablePatch {
@@ -43,13 +72,124 @@ namespace DB {
 		bool doUpdates {true};
 		/// Enable insertion
 		bool doInserts {true};
+		/// Evaluate the source expression once into a temporary table, indexed on the primary key, and patch
+		/// from that. Any where clause may then only refer to source columns in pk or cols.
+		bool materialiseSrc {false};
+		/// Patch in chunks of (up to) this many distinct values of the first primary key column (0 to patch in
+		/// one go).
+		unsigned int chunkSize {0};
+		/// What separates one chunk from the next.
+		PatchChunkBoundary chunkBoundary {PatchChunkBoundary::None};
+		/// An expression (with %1% standing for the table alias) of a hash of a row's non-key columns, either a
+		/// designated hash column ("%1%.hash") or computed on the fly (e.g. "md5(ROW(%1%.c, %1%.d)::text)"). When
+		/// set, rows are updated when their hashes differ, rather than comparing each column.
+		std::string rowHash;
+		/// Compare each column instead of the row hashes, guarding against hash collisions or stale hash columns
+		/// (e.g. for an occasional full check between hash-only runs).
+		bool verifyRowHash {false};
+		/// Perform updates and inserts in a single upsert where the connection supports it (counted in
+		/// PatchResult::upserts). ON CONFLICT style upserts require a unique constraint on exactly pk and can't
+		/// apply a where clause, so with one the patch falls back to separate updates and inserts. That only
+		/// applies to the caller's where clause; a chunked patch restricts each chunk's source instead, so still
+		/// upserts.
+		bool upsert {false};
+		/// A source column whose value increases whenever a row is inserted or changed (e.g. updated_at). When
+		/// set, updates and inserts only consider source rows beyond lastWatermark; deletes still compare the
+		/// whole source, so are best enabled only on an occasional full pass. Rows with a null watermark are
+		/// never considered.
+		ColumnName watermark;
+		/// The highest watermark value already patched (null to consider every source row). Each patch
+		/// advances it to the highest value in the source; persist it between runs.
+		PatchValue lastWatermark;
 		/// Before delete audit
 		AuditFunction beforeDelete;
 		/// Before update audit
 		AuditFunction beforeUpdate;
 		/// Before insert audit
 		AuditFunction beforeInsert;
+		/// After delete audit, given the deleted rows (cols) as returned by the delete itself. Only called where
+		/// the connection's ReturningStyle is Returning; use beforeDelete otherwise.
+		AuditFunction afterDelete;
+		/// After update audit, given the updated rows (cols, new values) as returned by the update itself. Only
+		/// called where the connection's ReturningStyle is Returning and its BulkUpdateStyle is UsingFromSrc, and
+		/// not for upserts; use beforeUpdate otherwise.
+		AuditFunction afterUpdate;
+		/// After insert audit, given the inserted rows (cols) as returned by the insert itself. Only called where
+		/// the connection's ReturningStyle is Returning, and not for upserts; use beforeInsert otherwise.
+		AuditFunction afterInsert;
 	};
+
+	/// A table patch whose SQL is generated, and whose modifications are prepared, once for repeated execution;
+	/// each execution only binds the parameters of the patch's SqlWriters afresh. Audit selects are still created
+	/// for each execution. Materialised, chunked and incremental (watermark) patches, whose SQL varies between
+	/// executions, aren't supported.
+	class DLL_PUBLIC PreparedTablePatch {
+	public:
+		/// Prepare a patch for execution on the given connection.
+		/// @param conn The connection to execute on.
+		/// @param tp The patch settings; any SqlWriters must outlive the prepared patch.
+		PreparedTablePatch(Connection & conn, const TablePatch & tp);
+		~PreparedTablePatch();
+		/// Standard special members
+		SPECIAL_MEMBERS_COPY(PreparedTablePatch, delete);
+		/// Standard special members
+		SPECIAL_MEMBERS_MOVE(PreparedTablePatch, delete);
+
+		/// Patch the table (the connection must be in a transaction).
+		PatchResult execute();
+
+	private:
+		Connection & conn;
+		std::unique_ptr<SqlWriter> src;
+		PatchSteps deletes, updates, inserts, upserts;
+	};
+
+	/// Dependencies between the destination tables of a multi-table patch; each table (key) maps to the tables it
+	/// references (values), i.e. those which must be written first and deleted from last.
+	using PatchDependencies = std::multimap<std::string, std::string>;
+
+	/// The outcome of one table's part of a multi-table patch.
+	struct TablePatchResult {
+		/// Rows changed.
+		PatchResult result {};
+		/// Time spent deleting.
+		std::chrono::steady_clock::duration deleteTime {};
+		/// Time spent updating and inserting.
+		std::chrono::steady_clock::duration writeTime {};
+	};
+
+	/// Patch several related tables in one transaction. Deletes are performed in reverse dependency order (tables
+	/// referencing others first), then updates and inserts in dependency order (referenced tables first).
+	/// @param conn The connection to patch on (must be in a transaction).
+	/// @param patches The patch settings of each table; watermarks are advanced in place.
+	/// @param deps Dependencies between the patches' destination tables (must not be cyclic).
+	/// @return The result of each patch, in the same order as patches.
+	DLL_PUBLIC std::vector<TablePatchResult> patchTables(
+			Connection & conn, std::vector<TablePatch> & patches, const PatchDependencies & deps);
+
+	/// Patch several related tables using several pooled connections concurrently. Tables which are related, even
+	/// indirectly, are patched together on one connection as per patchTables(Connection &, ...), each independent
+	/// group in its own transaction. All transactions are committed once every group has been patched, otherwise
+	/// all are rolled back. Note that commits are not atomic across connections.
+	/// @param pool The pool to take connections from (limited by free connections in the pool).
+	/// @param patches The patch settings of each table; watermarks are advanced in place.
+	/// @param deps Dependencies between the patches' destination tables (must not be cyclic).
+	/// @return The result of each patch, in the same order as patches.
+	DLL_PUBLIC std::vector<TablePatchResult> patchTables(
+			BasicConnectionPool & pool, std::vector<TablePatch> & patches, const PatchDependencies & deps);
+
+	/// Patch one table's contents into another using several pooled connections concurrently.
+	/// The key space (the first primary key column) is split into evenly sized ranges, each of which is patched
+	/// in full by one of the connections, in its own transaction. All transactions are committed once every
+	/// range has been patched, otherwise all are rolled back. Note that commits are not atomic across
+	/// connections. Any SqlWriters in the patch are used from several threads at once. Incremental (watermark)
+	/// patches aren't supported.
+	/// @param pool The pool to take connections from (limited by free connections in the pool).
+	/// @param tp The patch settings.
+	/// @param partitions The number of key ranges.
+	/// @return The combined result of patching every range.
+	DLL_PUBLIC PatchResult parallelPatchTable(
+			BasicConnectionPool & pool, const TablePatch & tp, unsigned int partitions);
 }
 
 #endif
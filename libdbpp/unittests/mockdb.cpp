@@ -6,6 +6,7 @@
 #include "factory.h"
 #include "mockDatabase.h"
 #include <memory>
+#include <string>
 
 // LCOV_EXCL_START
 
@@ -44,10 +45,15 @@ MockDb::bulkUpdateStyle() const
 void
 MockDb::execute(const std::string & sql, const DB::CommandOptionsCPtr &)
 {
-	if (sql.substr(0, 3) == "Not") {
-		throw DB::Error();
-	}
-	executed.push_back(sql);
+	interact([this, &sql]() {
+		if (sql.substr(0, 3) == "Not") {
+			throw DB::Error();
+		}
+		if (sql.substr(0, 4) == "Lost") {
+			throw DB::ConnectionError();
+		}
+		executed.push_back(sql);
+	});
 }
 
 DB::SelectCommandPtr
@@ -62,6 +68,30 @@ MockDb::modify(const std::string &, const DB::CommandOptionsCPtr &)
 	return nullptr;
 }
 
+void
+MockDb::beginBulkDownload(const char * source, const char *)
+{
+	downloadSource = source;
+}
+
+void
+MockDb::endBulkDownload(const char *)
+{
+	downloadSource.clear();
+}
+
+size_t
+MockDb::bulkDownloadData(const DB::BulkDownloadSink & sink) const
+{
+	size_t total = 0;
+	for (const auto row : {"1", "2", "3"}) {
+		const auto line = downloadSource + '\t' + row + '\n';
+		sink(line.data(), line.length());
+		total += line.length();
+	}
+	return total;
+}
+
 MockMock::MockMock(const std::string &, const std::string &, const std::vector<std::filesystem::path> & ss) :
 	DB::MockDatabase()
 {
@@ -24,7 +24,13 @@ public:
 	DB::SelectCommandPtr select(const std::string &, const DB::CommandOptionsCPtr &) override;
 	DB::ModifyCommandPtr modify(const std::string &, const DB::CommandOptionsCPtr &) override;
 
+	void beginBulkDownload(const char *, const char *) override;
+	void endBulkDownload(const char *) override;
+	using DB::Connection::bulkDownloadData;
+	size_t bulkDownloadData(const DB::BulkDownloadSink &) const override;
+
 	mutable std::vector<std::string> executed;
+	std::string downloadSource;
 };
 
 class MockMock : public DB::MockDatabase {
@@ -17,3 +17,35 @@ CREATE UNIQUE INDEX u ON target(a, b) WHERE NOT deleted;
 COPY source(a, b, c, d) FROM '$SCRIPTDIR/source.dat';
 COPY target(a, b, c, d) FROM '$SCRIPTDIR/target.dat';
 
+
+CREATE TABLE parent_source(
+		id integer,
+		name text,
+		PRIMARY KEY(id));
+
+CREATE TABLE parent_target(
+		id integer,
+		name text,
+		PRIMARY KEY(id));
+
+CREATE TABLE child_source(
+		id integer,
+		parent integer,
+		PRIMARY KEY(id));
+
+CREATE TABLE child_target(
+		id integer,
+		parent integer REFERENCES parent_target(id),
+		PRIMARY KEY(id));
+
+INSERT INTO parent_source VALUES(1, 'one'), (3, 'three');
+INSERT INTO parent_target VALUES(1, 'one'), (2, 'two');
+INSERT INTO child_source VALUES(2, 3);
+INSERT INTO child_target VALUES(1, 2);
+
+CREATE TABLE text_target(
+		k text COLLATE "C",
+		v text,
+		PRIMARY KEY(k));
+
+INSERT INTO text_target VALUES('B', 'b'), ('a', 'x'), ('c', 'c');
@@ -5,11 +5,15 @@
 #include "command_fwd.h"
 #include "mockdb.h"
 #include <connection.h>
+#include <cstdio>
 #include <exception>
 #include <factory.impl.h>
 #include <memory>
 #include <optional>
 #include <pq-command.h>
+#include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
 
 BOOST_AUTO_TEST_CASE(create)
@@ -84,6 +88,22 @@ BOOST_AUTO_TEST_CASE(txscope)
 	}
 }
 
+BOOST_AUTO_TEST_CASE(txscopeMove)
+{
+	auto mock = DB::ConnectionFactory::createNew("MockDb", "doesn't matter");
+	std::optional<DB::TransactionScope> moved;
+	{
+		DB::TransactionScope tx(*mock);
+		moved.emplace(std::move(tx));
+	}
+	// The moved from scope neither committed nor ended the thread's scope
+	BOOST_REQUIRE_EQUAL(true, mock->inTx());
+	BOOST_REQUIRE_EQUAL(mock.get(), DB::TransactionScope::current());
+	moved.reset();
+	BOOST_REQUIRE_EQUAL(false, mock->inTx());
+	BOOST_REQUIRE(!DB::TransactionScope::current());
+}
+
 BOOST_AUTO_TEST_CASE(savepoints)
 {
 	auto mock = DB::ConnectionFactory::createNew("MockDb", "doesn't matter");
@@ -101,6 +121,66 @@ BOOST_AUTO_TEST_CASE(savepoints)
 	BOOST_REQUIRE_EQUAL("ROLLBACK TO SAVEPOINT sp1", *mockdb->executed.rbegin());
 }
 
+BOOST_AUTO_TEST_CASE(activity)
+{
+	auto mock = DB::ConnectionFactory::createNew("MockDb", "doesn't matter");
+	BOOST_REQUIRE(mock);
+	auto last = mock->lastActivity();
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	mock->execute("SELECT 1");
+	BOOST_REQUIRE(mock->lastActivity() > last);
+	last = mock->lastActivity();
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	BOOST_REQUIRE(!mock->hasFailed());
+	// A rejected statement says nothing about the connection
+	BOOST_REQUIRE_THROW(mock->execute("Not valid"), DB::Error);
+	BOOST_REQUIRE(mock->lastActivity() == last);
+	BOOST_REQUIRE(!mock->hasFailed());
+	BOOST_REQUIRE_THROW(mock->execute("Lost connection"), DB::ConnectionError);
+	BOOST_REQUIRE(mock->lastActivity() == last);
+	BOOST_REQUIRE(mock->hasFailed());
+	mock->beginTx();
+	BOOST_REQUIRE(mock->lastActivity() > last);
+	mock->commitTx();
+	last = mock->lastActivity();
+	std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	BOOST_REQUIRE_EQUAL(3, mock->interact([]() {
+		return 3;
+	}));
+	BOOST_REQUIRE(mock->lastActivity() > last);
+}
+
+BOOST_AUTO_TEST_CASE(bulkDownloadStream)
+{
+	auto mock = DB::ConnectionFactory::createNew("MockDb", "doesn't matter");
+	BOOST_REQUIRE(mock);
+	mock->beginBulkDownload("tbl", nullptr);
+	std::stringstream out;
+	BOOST_REQUIRE_EQUAL(18, mock->bulkDownloadData(out));
+	mock->endBulkDownload(nullptr);
+	BOOST_REQUIRE_EQUAL("tbl\t1\ntbl\t2\ntbl\t3\n", out.str());
+}
+
+BOOST_AUTO_TEST_CASE(bulkDownloadFile)
+{
+	auto mock = DB::ConnectionFactory::createNew("MockDb", "doesn't matter");
+	BOOST_REQUIRE(mock);
+	auto out = tmpfile();
+	BOOST_REQUIRE(out);
+	mock->beginBulkDownload("tbl", nullptr);
+	BOOST_REQUIRE_EQUAL(18, mock->bulkDownloadData(out));
+	fflush(out);
+	mock->beginBulkDownload("x", nullptr);
+	BOOST_REQUIRE_EQUAL(12, mock->bulkDownloadData(fileno(out)));
+	mock->endBulkDownload(nullptr);
+	rewind(out);
+	std::string content(30, '\0');
+	BOOST_REQUIRE_EQUAL(18, fread(content.data(), 1, 18, out));
+	BOOST_REQUIRE_EQUAL(12, fread(content.data() + 18, 1, 12, out));
+	fclose(out);
+	BOOST_REQUIRE_EQUAL("tbl\t1\ntbl\t2\ntbl\t3\nx\t1\nx\t2\nx\t3\n", content);
+}
+
 BOOST_AUTO_TEST_CASE(commandOptions)
 {
 	auto optsDefault = DB::CommandOptionsFactory::createNew("", 1234, {});
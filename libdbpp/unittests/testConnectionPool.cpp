@@ -3,18 +3,35 @@
 
 #include "connection.h"
 #include "mockDatabase.h"
+#include <atomic>
 #include <buffer.h>
+#include <chrono>
 #include <connectionPool.h>
+#include <cstdint>
+#include <definedDirs.h>
+#include <future>
+#include <ingestQueue.h>
 #include <memory>
+#include <multiEndpointPool.h>
+#include <mutex>
+#include <optional>
+#include <parallelBulkUpload.h>
+#include <poolMetrics.h>
 #include <pq-mock.h>
+#include <readWriteRouter.h>
 #include <resourcePool.impl.h>
+#include <selectcommand.h>
+#include <selectcommandUtil.impl.h>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 class MockPool : public DB::PluginMock<PQ::Mock>, public DB::ConnectionPool {
 public:
-	MockPool() :
-		PluginMock<PQ::Mock>("pqmock", {}, "user=postgres dbname=postgres"), DB::ConnectionPool(4, 2, "postgresql",
-																					 stringbf("user=postgres dbname=%s",
-																							 databaseName()))
+	explicit MockPool(DB::ConnectionPoolMode mode = DB::ConnectionPoolMode::Shared) :
+		PluginMock<PQ::Mock>("pqmock", {}, "user=postgres dbname=postgres"),
+		DB::ConnectionPool(4, 2, "postgresql", stringbf("user=postgres dbname=%s", databaseName()), mode)
 	{
 	}
 };
@@ -47,3 +64,610 @@ BOOST_AUTO_TEST_CASE(basic)
 	BOOST_REQUIRE_EQUAL(0, pool.inUseCount());
 	BOOST_REQUIRE_EQUAL(2, pool.availableCount());
 }
+
+static int64_t
+backendPid(DB::Connection * c)
+{
+	int64_t pid = 0;
+	c->select("SELECT pg_backend_pid()")->forEachRow<int64_t>([&pid](auto p) {
+		pid = p;
+	});
+	return pid;
+}
+
+BOOST_AUTO_TEST_CASE(pingWhenIdle)
+{
+	MockPool pool;
+	auto killer = DB::MockDatabase::openConnectionTo("pqmock");
+	int64_t pid = 0;
+	{
+		auto c = pool.get();
+		pid = backendPid(c.get());
+	}
+	killer->execute(stringbf("SELECT pg_terminate_backend(%d)", pid));
+	// Always ping (default), the dead connection is replaced
+	auto c = pool.get();
+	BOOST_REQUIRE_NE(pid, backendPid(c.get()));
+}
+
+BOOST_AUTO_TEST_CASE(skipPingWhenActive)
+{
+	MockPool pool;
+	pool.pingAfterIdle = std::chrono::hours(1);
+	DB::Connection * cr;
+	{
+		auto c = pool.get();
+		cr = c.get();
+	}
+	const auto returned = cr->lastActivity();
+	{
+		auto c = pool.get();
+		BOOST_REQUIRE_EQUAL(cr, c.get());
+		// Handed out without a ping, so no new activity
+		BOOST_REQUIRE(returned == c->lastActivity());
+	}
+	const auto returnedAgain = cr->lastActivity();
+	pool.pingAfterIdle = std::chrono::milliseconds(1);
+	std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	{
+		auto c = pool.get();
+		BOOST_REQUIRE_EQUAL(cr, c.get());
+		// Pinged, as it was idle
+		BOOST_REQUIRE(returnedAgain < c->lastActivity());
+	}
+}
+
+BOOST_AUTO_TEST_CASE(retireFailed)
+{
+	for (const auto mode : {DB::ConnectionPoolMode::Shared, DB::ConnectionPoolMode::ThreadAffinity}) {
+		MockPool pool(mode);
+		DB::Connection * cr;
+		{
+			auto c = pool.get();
+			cr = c.get();
+			// A failed statement leaves the connection fit for reuse
+			BOOST_REQUIRE_THROW(c->execute("SELECT nonexistent()"), DB::Error);
+			BOOST_REQUIRE(!c->hasFailed());
+		}
+		{
+			auto c = pool.get();
+			BOOST_REQUIRE_EQUAL(cr, c.get());
+			BOOST_REQUIRE_THROW(c->interact([]() {
+				throw DB::ConnectionError();
+			}),
+					DB::ConnectionError);
+			BOOST_REQUIRE(c->hasFailed());
+		}
+		// Released normally, but the failure means it is closed rather than reused
+		auto c = pool.get();
+		BOOST_REQUIRE(!c->hasFailed());
+	}
+}
+
+BOOST_AUTO_TEST_CASE(threadAffinity)
+{
+	MockPool pool(DB::ConnectionPoolMode::ThreadAffinity);
+	DB::Connection * cr;
+	{
+		auto c = pool.get();
+		cr = c.get();
+	}
+	{
+		auto c = pool.get();
+		BOOST_REQUIRE_EQUAL(cr, c.get());
+		auto c2 = pool.get();
+		BOOST_REQUIRE_NE(cr, c2.get());
+		auto c3 = pool.get();
+		auto c4 = pool.get();
+		BOOST_REQUIRE_EQUAL(4, pool.inUseCount());
+	}
+	// Idle slotted connections are available, not in use
+	BOOST_REQUIRE_EQUAL(0, pool.inUseCount());
+	BOOST_REQUIRE_EQUAL(2, pool.availableCount());
+	BOOST_REQUIRE_EQUAL(0, pool.metrics().inUse);
+	{
+		// Each thread gets back the connection it used last
+		DB::Connection *mine = nullptr, *other = nullptr, *otherAgain = nullptr;
+		{
+			auto c = pool.get();
+			mine = c.get();
+			std::thread([&pool, &other]() {
+				other = pool.get().get();
+			}).join();
+		}
+		BOOST_REQUIRE_NE(mine, other);
+		std::thread([&pool, &otherAgain]() {
+			otherAgain = pool.get().get();
+		}).join();
+		BOOST_REQUIRE_EQUAL(other, otherAgain);
+		BOOST_REQUIRE_EQUAL(mine, pool.get().get());
+	}
+	{
+		auto c = pool.get();
+		c->beginTx();
+	}
+	// Left in a transaction, so replaced rather than reused
+	auto c = pool.get();
+	BOOST_REQUIRE(!c->inTx());
+}
+
+// Returns the rate of checkouts, per second
+static double
+checkoutContention(DB::ConnectionPoolMode mode, int threadCount = 8, int perThread = 10000)
+{
+	MockPool pool(mode);
+	pool.pingAfterIdle = std::chrono::hours(1);
+	{
+		// Open the kept connections up front
+		auto c1 = pool.get();
+		auto c2 = pool.get();
+	}
+	const auto before = pool.metrics();
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (int t = 0; t < threadCount; t++) {
+		threads.emplace_back([&pool, perThread]() {
+			for (int i = 0; i < perThread; i++) {
+				auto c = pool.get(1000);
+			}
+		});
+	}
+	for (auto & t : threads) {
+		t.join();
+	}
+	const std::chrono::duration<double> taken = std::chrono::steady_clock::now() - start;
+	const auto after = pool.metrics();
+	BOOST_REQUIRE_EQUAL(threadCount * perThread, after.checkouts - before.checkouts);
+	BOOST_REQUIRE_EQUAL(0, after.timeouts);
+	BOOST_REQUIRE_EQUAL(0, pool.inUseCount());
+	BOOST_REQUIRE_EQUAL(2, pool.availableCount());
+	return (threadCount * perThread) / taken.count();
+}
+
+BOOST_AUTO_TEST_CASE(contention)
+{
+	checkoutContention(DB::ConnectionPoolMode::Shared);
+	checkoutContention(DB::ConnectionPoolMode::ThreadAffinity);
+}
+
+BOOST_AUTO_TEST_CASE(contentionThroughput, *boost::unit_test::label("perf"))
+{
+	for (const auto threadCount : {1, 2, 8}) {
+		const auto shared = checkoutContention(DB::ConnectionPoolMode::Shared, threadCount, 50000);
+		const auto affinity = checkoutContention(DB::ConnectionPoolMode::ThreadAffinity, threadCount, 50000);
+		BOOST_TEST_MESSAGE(threadCount << " threads: shared " << static_cast<uint64_t>(shared)
+									   << " checkouts/s, thread affinity " << static_cast<uint64_t>(affinity)
+									   << " checkouts/s");
+		BOOST_CHECK_GT(shared, 0);
+		BOOST_CHECK_GT(affinity, 0);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(warm)
+{
+	MockPool pool;
+	pool.initScript = rootDir / "warm.sql";
+	const auto ready = pool.warm(4, 4);
+	BOOST_TEST_MESSAGE("Warmed in " << std::chrono::duration_cast<std::chrono::milliseconds>(ready).count() << "ms");
+	// Capped at keep
+	BOOST_REQUIRE_EQUAL(2, pool.availableCount());
+	BOOST_REQUIRE_EQUAL(0, pool.inUseCount());
+	auto c1 = pool.get();
+	auto c2 = pool.get();
+	BOOST_REQUIRE_EQUAL(0, pool.availableCount());
+	// Opened on demand, still initialised
+	auto c3 = pool.get();
+	for (const auto & c : {c1, c2, c3}) {
+		c->select("SELECT COUNT(*) FROM warmed")->forEachRow<int64_t>([](auto n) {
+			BOOST_REQUIRE_EQUAL(1, n);
+		});
+	}
+	// Already open
+	pool.warm(2, 2);
+	BOOST_REQUIRE_EQUAL(0, pool.availableCount());
+}
+
+BOOST_AUTO_TEST_CASE(metrics)
+{
+	MockPool pool;
+	{
+		auto c1 = pool.get();
+		auto c2 = pool.get();
+		auto c3 = pool.get();
+		auto c4 = pool.get();
+		BOOST_REQUIRE_THROW(pool.get(10), AdHoc::TimeOutOnResourcePool);
+		const auto m = pool.metrics();
+		BOOST_REQUIRE_EQUAL(4, m.inUse);
+		BOOST_REQUIRE_EQUAL(0, m.available);
+	}
+	{
+		auto c = pool.get();
+	}
+	const auto m = pool.metrics();
+	BOOST_REQUIRE_EQUAL(5, m.checkouts);
+	BOOST_REQUIRE_EQUAL(1, m.timeouts);
+	BOOST_REQUIRE_EQUAL(4, m.creates);
+	BOOST_REQUIRE_EQUAL(2, m.destroys);
+	BOOST_REQUIRE_EQUAL(0, m.pingFailures);
+	BOOST_REQUIRE_EQUAL(0, m.inUse);
+	BOOST_REQUIRE_EQUAL(2, m.available);
+	BOOST_REQUIRE_EQUAL(5, m.checkoutWait.count);
+	BOOST_REQUIRE_EQUAL(5, m.hold.count);
+	BOOST_REQUIRE_EQUAL(4, m.create.count);
+	BOOST_REQUIRE_GT(m.create.mean().count(), 0);
+	BOOST_REQUIRE_EQUAL(1, m.ping.count);
+	BOOST_REQUIRE_LE(m.checkoutWait.quantile(0.5), m.checkoutWait.max);
+}
+
+BOOST_AUTO_TEST_CASE(latencyHistogram)
+{
+	DB::LatencyHistogram h;
+	for (int i = 1; i <= 1000; i++) {
+		h.record(std::chrono::microseconds(i));
+	}
+	const auto s = h.snapshot();
+	BOOST_REQUIRE_EQUAL(1000, s.count);
+	BOOST_REQUIRE_EQUAL(1000, s.max.count());
+	BOOST_REQUIRE_EQUAL(500, s.mean().count());
+	BOOST_REQUIRE_GE(s.quantile(0.5).count(), 384);
+	BOOST_REQUIRE_LE(s.quantile(0.5).count(), 500);
+	BOOST_REQUIRE_EQUAL(1000, s.quantile(1).count());
+}
+
+BOOST_AUTO_TEST_CASE(fairCheckout)
+{
+	MockPool pool;
+	std::vector<int> order;
+	std::mutex orderLock;
+	std::vector<std::thread> waiters;
+	{
+		auto c1 = pool.get();
+		auto c2 = pool.get();
+		auto c3 = pool.get();
+		auto c4 = pool.get();
+		for (int i = 0; i < 4; i++) {
+			waiters.emplace_back([&pool, &order, &orderLock, i]() {
+				auto c = pool.get();
+				std::lock_guard<std::mutex> l(orderLock);
+				order.push_back(i);
+			});
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+		// Queued behind the others, so fails at the deadline
+		const auto start = std::chrono::steady_clock::now();
+		BOOST_REQUIRE_THROW(pool.get(start + std::chrono::milliseconds(20)), AdHoc::TimeOutOnResourcePool);
+		BOOST_REQUIRE_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(200));
+	}
+	for (auto & w : waiters) {
+		w.join();
+	}
+	const std::vector<int> expected {0, 1, 2, 3};
+	BOOST_CHECK_EQUAL_COLLECTIONS(order.begin(), order.end(), expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE(asyncCheckout)
+{
+	MockPool pool;
+	std::vector<DB::ConnectionHandle> held;
+	for (int i = 0; i < 4; i++) {
+		held.push_back(pool.getAsync().get());
+	}
+	// Checked out on the pool's behalf, not this thread's
+	BOOST_REQUIRE_THROW(pool.getMine(), AdHoc::NoCurrentResource);
+	{
+		// Dropped without waiting, gives up its place
+		auto dropped = pool.getAsync();
+	}
+	auto waiting = pool.getAsync();
+	auto late = pool.getAsync(std::chrono::steady_clock::now() + std::chrono::milliseconds(20));
+	BOOST_REQUIRE_THROW(late.get(), AdHoc::TimeOutOnResourcePool);
+	BOOST_REQUIRE(waiting.wait_for(std::chrono::milliseconds(10)) == std::future_status::timeout);
+	auto released = held.back().get();
+	held.pop_back();
+	BOOST_REQUIRE_EQUAL(released, waiting.get().get());
+}
+
+BOOST_AUTO_TEST_CASE(maintenance)
+{
+	MockPool pool;
+	{
+		auto c1 = pool.get();
+		auto c2 = pool.get();
+	}
+	DB::ConnectionPoolMaintenance settings;
+	settings.maxIdle = std::chrono::milliseconds(50);
+	pool.maintain(settings);
+	BOOST_REQUIRE_EQUAL(2, pool.availableCount());
+	DB::Connection * cr;
+	{
+		auto c = pool.get();
+		cr = c.get();
+		std::this_thread::sleep_for(std::chrono::milliseconds(60));
+	}
+	// Only the connection used recently remains
+	pool.maintain(settings);
+	BOOST_REQUIRE_EQUAL(1, pool.availableCount());
+	BOOST_REQUIRE_EQUAL(cr, pool.get().get());
+	// Replaced once past its lifetime
+	settings.maxLifetime = std::chrono::milliseconds(1);
+	settings.minOpen = 2;
+	const auto replaced = std::chrono::steady_clock::now();
+	pool.maintain(settings);
+	BOOST_REQUIRE_EQUAL(2, pool.availableCount());
+	{
+		auto c1 = pool.get();
+		auto c2 = pool.get();
+		BOOST_REQUIRE(c1->opened() >= replaced);
+		BOOST_REQUIRE(c2->opened() >= replaced);
+	}
+	BOOST_REQUIRE_EQUAL(2, pool.metrics().destroys);
+}
+
+BOOST_AUTO_TEST_CASE(backgroundMaintenance)
+{
+	MockPool pool;
+	DB::ConnectionPoolMaintenance settings;
+	settings.interval = std::chrono::milliseconds(10);
+	settings.minOpen = 2;
+	DB::ConnectionPoolMaintainer maintainer(pool, settings);
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	BOOST_REQUIRE_EQUAL(2, pool.availableCount());
+}
+
+BOOST_AUTO_TEST_CASE(backgroundMaintenanceInterval)
+{
+	MockPool pool;
+	DB::ConnectionPoolMaintenance settings;
+	settings.interval = std::chrono::milliseconds(0);
+	BOOST_REQUIRE_THROW(DB::ConnectionPoolMaintainer(pool, settings), std::invalid_argument);
+	settings.interval = std::chrono::milliseconds(-1);
+	BOOST_REQUIRE_THROW(DB::ConnectionPoolMaintainer(pool, settings), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(multiEndpoint)
+{
+	DB::PluginMock<PQ::Mock> mock("pqmock", {}, "user=postgres dbname=postgres");
+	const auto good = stringbf("user=postgres dbname=%s", mock.databaseName());
+	DB::MultiEndpointPool pool({{"postgresql", good}, {"postgresql", good}});
+	BOOST_REQUIRE_EQUAL(2, pool.endpointCount());
+	// Least outstanding spreads checkouts evenly
+	auto c1 = pool.get();
+	auto c2 = pool.get();
+	auto c3 = pool.get();
+	auto c4 = pool.get();
+	BOOST_REQUIRE_EQUAL(2, pool.endpointPool(0).inUseCount());
+	BOOST_REQUIRE_EQUAL(2, pool.endpointPool(1).inUseCount());
+	BOOST_REQUIRE(!pool.ejected(0));
+	BOOST_REQUIRE(!pool.ejected(1));
+}
+
+BOOST_AUTO_TEST_CASE(multiEndpointFull)
+{
+	DB::PluginMock<PQ::Mock> mock("pqmock", {}, "user=postgres dbname=postgres");
+	const auto good = stringbf("user=postgres dbname=%s", mock.databaseName());
+	DB::MultiEndpointPoolOptions opts;
+	opts.max = 1;
+	opts.keep = 1;
+	DB::MultiEndpointPool pool({{"postgresql", good}, {"postgresql", good}}, opts);
+	std::optional<DB::ConnectionHandle> c1 = pool.get();
+	auto c2 = pool.get();
+	auto * const released = c1->get();
+	// Both endpoints are full, so this waits for whichever has a connection returned
+	std::thread release([&c1]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		c1.reset();
+	});
+	auto c3 = pool.get();
+	release.join();
+	BOOST_REQUIRE_EQUAL(released, c3.get());
+	BOOST_REQUIRE(!pool.ejected(0));
+	BOOST_REQUIRE(!pool.ejected(1));
+}
+
+BOOST_AUTO_TEST_CASE(multiEndpointEject)
+{
+	DB::PluginMock<PQ::Mock> mock("pqmock", {}, "user=postgres dbname=postgres");
+	DB::MultiEndpointPool pool({{"postgresql", "user=postgres dbname=nonexistent"},
+			{"postgresql", stringbf("user=postgres dbname=%s", mock.databaseName())}});
+	for (int i = 0; i < 3; i++) {
+		auto c = pool.get();
+		c->ping();
+	}
+	BOOST_REQUIRE(pool.ejected(0));
+	BOOST_REQUIRE(!pool.ejected(1));
+	BOOST_REQUIRE_EQUAL(0, pool.endpointPool(0).availableCount());
+	BOOST_REQUIRE_EQUAL(1, pool.endpointPool(1).availableCount());
+	// Explicitly ejected after an error in use
+	pool.failed(pool.get());
+	BOOST_REQUIRE(pool.ejected(1));
+	// All ejected, still tried
+	auto c = pool.get();
+	BOOST_REQUIRE(c);
+	BOOST_REQUIRE_GT(pool.latency(1).count(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(readWriteRouter)
+{
+	MockPool primary;
+	DB::ConnectionPool replica(2, 2, "postgresql", stringbf("user=postgres dbname=%s", primary.databaseName()));
+	const auto primaryPid = backendPid(primary.get().get());
+	const auto replicaPid = backendPid(replica.get().get());
+	DB::ReadWriteRouter router(primary, replica);
+	BOOST_REQUIRE_EQUAL(replicaPid, backendPid(&router));
+	BOOST_REQUIRE_EQUAL(0, primary.inUseCount());
+	BOOST_REQUIRE(!router.sticky());
+	{
+		DB::TransactionScope tx(router);
+		BOOST_REQUIRE_EQUAL(primaryPid, backendPid(&router));
+		router.execute("CREATE TEMP TABLE routedTx(i int)");
+		BOOST_REQUIRE(router.sticky());
+	}
+	// Back to the replica once the transaction ends
+	BOOST_REQUIRE(!router.sticky());
+	BOOST_REQUIRE_EQUAL(replicaPid, backendPid(&router));
+	BOOST_REQUIRE_EQUAL(1, primary.inUseCount());
+	BOOST_REQUIRE_EQUAL(1, replica.inUseCount());
+}
+
+BOOST_AUTO_TEST_CASE(readWriteRouterWrite)
+{
+	MockPool primary;
+	DB::ConnectionPool replica(2, 2, "postgresql", stringbf("user=postgres dbname=%s", primary.databaseName()));
+	DB::ReadWriteRouter router(primary, replica);
+	router.execute("CREATE TEMP TABLE routed(i int)");
+	BOOST_REQUIRE(router.sticky());
+	router.modify("INSERT INTO routed VALUES(1)")->execute();
+	// Temp table only visible on the primary
+	router.select("SELECT COUNT(*) FROM routed")->forEachRow<int64_t>([](auto n) {
+		BOOST_REQUIRE_EQUAL(1, n);
+	});
+	BOOST_REQUIRE_EQUAL(0, replica.inUseCount());
+}
+
+BOOST_AUTO_TEST_CASE(pooledCommands)
+{
+	MockPool pool(DB::ConnectionPoolMode::ThreadAffinity);
+	pool.get()->execute("CREATE TABLE pooled(i int)");
+	DB::SelectCommandPtr first;
+	{
+		auto other = pool.get();
+		auto sel = pool.getSelect("SELECT COUNT(*) FROM pooled");
+		BOOST_REQUIRE_NE(other.get(), sel.connection.get());
+		first = sel.command;
+	}
+	for (int i = 0; i < 3; i++) {
+		// The connection with the command prepared is preferred, wherever it is
+		auto sel = pool.getSelect("SELECT COUNT(*) FROM pooled");
+		BOOST_REQUIRE_EQUAL(first, sel.command);
+		sel.command->forEachRow<int64_t>([i](auto n) {
+			BOOST_REQUIRE_EQUAL(i, n);
+		});
+		auto ins = pool.getModify("INSERT INTO pooled VALUES(?)");
+		BOOST_REQUIRE_NE(sel.connection.get(), ins.connection.get());
+		ins.command->bindParamI(0, i);
+		ins.command->execute();
+	}
+}
+
+BOOST_AUTO_TEST_CASE(transactionScopeSticky)
+{
+	MockPool pool;
+	// Not the first connection this thread has
+	auto first = pool.get();
+	auto c = pool.get();
+	{
+		DB::TransactionScope tx(*c.get());
+		BOOST_REQUIRE_EQUAL(c.get(), DB::TransactionScope::current());
+		c->execute("CREATE TABLE sticky(i int)");
+		// Deeper layers get the connection in the transaction, and see its uncommitted work
+		auto inner = pool.get();
+		BOOST_REQUIRE_EQUAL(c.get(), inner.get());
+		BOOST_REQUIRE_EQUAL(2, pool.inUseCount());
+		inner->execute("INSERT INTO sticky VALUES(1)");
+		// Nested commands don't disturb those further up
+		auto outer = pool.getSelect("SELECT i FROM sticky");
+		auto nested = pool.getSelect("SELECT i FROM sticky");
+		BOOST_REQUIRE_EQUAL(c.get(), nested.connection.get());
+		BOOST_REQUIRE_NE(outer.command.get(), nested.command.get());
+	}
+	BOOST_REQUIRE_EQUAL(2, pool.inUseCount());
+	BOOST_REQUIRE(!DB::TransactionScope::current());
+	auto other = pool.get();
+	BOOST_REQUIRE_NE(c.get(), other.get());
+	other->select("SELECT COUNT(*) FROM sticky")->forEachRow<int64_t>([](auto n) {
+		BOOST_REQUIRE_EQUAL(1, n);
+	});
+}
+
+BOOST_AUTO_TEST_CASE(parallelLoad)
+{
+	MockPool pool;
+	pool.get()->execute("CREATE TABLE parallel(a int, b text)");
+	std::stringstream in;
+	for (int i = 1; i <= 1000; i++) {
+		in << i << "\trow " << i << "\n";
+	}
+	DB::ParallelBulkUploadOptions opts;
+	opts.connections = 3;
+	opts.chunkSize = 512;
+	BOOST_REQUIRE_EQUAL(in.str().length(), DB::parallelBulkUpload(pool, "parallel", in, opts));
+	BOOST_REQUIRE_EQUAL(0, pool.inUseCount());
+	pool.get()->select("SELECT COUNT(*), SUM(a) FROM parallel")->forEachRow<int64_t, int64_t>([](auto n, auto a) {
+		BOOST_REQUIRE_EQUAL(1000, n);
+		BOOST_REQUIRE_EQUAL(500500, a);
+	});
+}
+
+BOOST_AUTO_TEST_CASE(parallelLoadFails)
+{
+	MockPool pool;
+	pool.get()->execute("CREATE TABLE parallel(a int, b text)");
+	std::stringstream in;
+	for (int i = 1; i <= 1000; i++) {
+		in << i << "\trow " << i << "\n";
+	}
+	in << "not a number\tbad row\n";
+	DB::ParallelBulkUploadOptions opts;
+	opts.connections = 3;
+	opts.chunkSize = 512;
+	BOOST_REQUIRE_THROW(DB::parallelBulkUpload(pool, "parallel", in, opts), DB::Error);
+	pool.get()->select("SELECT COUNT(*) FROM parallel")->forEachRow<int64_t>([](auto n) {
+		BOOST_REQUIRE_EQUAL(0, n);
+	});
+}
+
+BOOST_AUTO_TEST_CASE(ingest)
+{
+	MockPool pool;
+	pool.get()->execute("CREATE TABLE ingest(t int, i int)");
+	std::atomic<std::size_t> rows {0};
+	{
+		DB::IngestQueueOptions opts;
+		opts.interval = std::chrono::milliseconds(10);
+		DB::IngestQueue queue(pool, "ingest", {"t", "i"}, opts, [&rows](const DB::IngestFlushReport & r) {
+			if (!r.error) {
+				rows += r.rows;
+			}
+		});
+		std::vector<std::thread> producers;
+		for (int t = 0; t < 4; t++) {
+			producers.emplace_back([&queue, t]() {
+				for (int i = 0; i < 1000; i++) {
+					queue.push(t, i);
+				}
+			});
+		}
+		for (auto & p : producers) {
+			p.join();
+		}
+	}
+	BOOST_REQUIRE_EQUAL(4000, rows);
+	pool.get()
+			->select("SELECT COUNT(*), COUNT(DISTINCT t) FROM ingest")
+			->forEachRow<int64_t, int64_t>([](auto n, auto t) {
+				BOOST_REQUIRE_EQUAL(4000, n);
+				BOOST_REQUIRE_EQUAL(4, t);
+			});
+}
+
+BOOST_AUTO_TEST_CASE(ingestDrop)
+{
+	MockPool pool;
+	pool.get()->execute("CREATE TABLE ingest(i int)");
+	uint64_t dropped = 0;
+	{
+		DB::IngestQueueOptions opts;
+		opts.maxBytes = 100;
+		opts.interval = std::chrono::seconds(10);
+		opts.overflow = DB::IngestOverflowPolicy::Drop;
+		DB::IngestQueue queue(pool, "ingest", {"i"}, opts);
+		for (int i = 0; i < 100; i++) {
+			queue.push(10000 + i);
+		}
+		dropped = queue.dropped();
+	}
+	BOOST_REQUIRE_EQUAL(84, dropped);
+	pool.get()->select("SELECT COUNT(*) FROM ingest")->forEachRow<int64_t>([](auto n) {
+		BOOST_REQUIRE_EQUAL(16, n);
+	});
+}
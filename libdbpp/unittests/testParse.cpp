@@ -149,3 +149,20 @@ BOOST_AUTO_TEST_CASE(parseUnterminateString)
 {
 	assertFail(rootDir / "unterminatedString.sql");
 }
+
+BOOST_AUTO_TEST_CASE(readOnlySql)
+{
+	BOOST_REQUIRE(DB::isReadOnlySql("SELECT 1"));
+	BOOST_REQUIRE(DB::isReadOnlySql("  select updated_at from t where c = 'x'"));
+	BOOST_REQUIRE(DB::isReadOnlySql("-- DELETE in a comment\nSELECT 1"));
+	BOOST_REQUIRE(DB::isReadOnlySql("/* INSERT */ SELECT 1; SELECT 2;"));
+	BOOST_REQUIRE(DB::isReadOnlySql("WITH x AS (SELECT 1) SELECT * FROM x"));
+	BOOST_REQUIRE(DB::isReadOnlySql("SELECT 1 -- trailing comment"));
+	BOOST_REQUIRE(!DB::isReadOnlySql("WITH x AS (DELETE FROM t RETURNING *) SELECT * FROM x"));
+	BOOST_REQUIRE(!DB::isReadOnlySql("SELECT * FROM t FOR UPDATE"));
+	BOOST_REQUIRE(!DB::isReadOnlySql("SELECT * INTO t2 FROM t"));
+	BOOST_REQUIRE(!DB::isReadOnlySql("INSERT INTO t VALUES(1)"));
+	BOOST_REQUIRE(!DB::isReadOnlySql("SELECT 1; DELETE FROM t"));
+	BOOST_REQUIRE(!DB::isReadOnlySql("SELECT 'unterminated"));
+	BOOST_REQUIRE(!DB::isReadOnlySql(""));
+}
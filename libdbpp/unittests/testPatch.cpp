@@ -7,17 +7,24 @@
 #include <buffer.h>
 #include <command.h>
 #include <connection.h>
+#include <connectionPool.h>
 #include <cstdint>
 #include <cstdio>
 #include <definedDirs.h>
 #include <filesystem>
 #include <memory>
+#include <mergePatch.h>
 #include <pq-mock.h>
+#include <readWriteRouter.h>
+#include <resourcePool.impl.h>
 #include <selectcommandUtil.impl.h>
 #include <sqlWriter.h>
+#include <stdexcept>
 #include <string>
 #include <tablepatch.h>
 #include <tuple>
+#include <variant>
+#include <vector>
 
 class Mock : public DB::PluginMock<PQ::Mock> {
 public:
@@ -271,3 +278,543 @@ BOOST_AUTO_TEST_CASE(testSrcExprSelectFilteredTable)
 	BOOST_REQUIRE_EQUAL(1, r.inserts);
 	BOOST_REQUIRE_EQUAL(1, r.updates);
 }
+
+class CountingBindInt : public BindInt {
+public:
+	using BindInt::BindInt;
+
+	void
+	bindParams(DB::Command * c, unsigned int & offset) override
+	{
+		binds += 1;
+		BindInt::bindParams(c, offset);
+	}
+
+	unsigned int binds {0};
+};
+
+BOOST_AUTO_TEST_CASE(testSrcExprMaterialised)
+{
+	Mock mock;
+	CountingBindInt s("(SELECT s.* FROM source s WHERE s.a = ?)", 1);
+	auto db = DB::MockDatabase::openConnectionTo("pqmock");
+	BOOST_REQUIRE(db);
+	DB::TablePatch tp;
+	tp.srcExpr = &s;
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	tp.materialiseSrc = true;
+	unsigned int audited = 0;
+	tp.beforeDelete = tp.beforeUpdate = tp.beforeInsert = [&audited](const DB::SelectCommandPtr & i) {
+		while (i->fetch()) {
+			audited += 1;
+		}
+	};
+	db->beginTx();
+	auto r = db->patchTable(&tp);
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(2, r.deletes);
+	BOOST_REQUIRE_EQUAL(1, r.inserts);
+	BOOST_REQUIRE_EQUAL(1, r.updates);
+	BOOST_REQUIRE_EQUAL(4, audited);
+	BOOST_REQUIRE_EQUAL(1, s.binds);
+	BOOST_REQUIRE_EQUAL(&s, tp.srcExpr);
+}
+
+BOOST_AUTO_TEST_CASE(testSrcExprMaterialisedFailure)
+{
+	Mock mock;
+	auto db = DB::MockDatabase::openConnectionTo("pqmock");
+	BOOST_REQUIRE(db);
+	DB::TablePatch tp;
+	tp.src = "source";
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	tp.materialiseSrc = true;
+	tp.beforeUpdate = [](const DB::SelectCommandPtr &) {
+		throw std::runtime_error("audit failed");
+	};
+	db->beginTx();
+	BOOST_REQUIRE_THROW(db->patchTable(&tp), std::runtime_error);
+	db->select("SELECT COUNT(*) FROM pg_class WHERE relname LIKE 'patchsrc\\_%'")->forEachRow<int64_t>([](auto n) {
+		BOOST_REQUIRE_EQUAL(0, n);
+	});
+	db->commitTx();
+}
+
+BOOST_AUTO_TEST_CASE(testSrcExprMaterialisedAborted)
+{
+	Mock mock;
+	auto db = DB::MockDatabase::openConnectionTo("pqmock");
+	BOOST_REQUIRE(db);
+	DB::TablePatch tp;
+	tp.src = "source";
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	tp.materialiseSrc = true;
+	tp.chunkSize = 1;
+	tp.chunkBoundary = DB::PatchChunkBoundary::Commit;
+	unsigned int chunks = 0;
+	// Fails a later chunk with an error which aborts its transaction
+	tp.beforeDelete = [&chunks, &db](const DB::SelectCommandPtr &) {
+		if (++chunks == 2) {
+			db->execute("SELECT nonexistent()");
+		}
+	};
+	BOOST_REQUIRE_THROW(db->patchTable(&tp), DB::Error);
+	BOOST_REQUIRE(!db->inTx());
+	// Dropped once rolled back, though created in a committed chunk
+	db->select("SELECT COUNT(*) FROM pg_class WHERE relname LIKE 'patchsrc\\_%'")->forEachRow<int64_t>([](auto n) {
+		BOOST_REQUIRE_EQUAL(0, n);
+	});
+}
+
+BOOST_AUTO_TEST_CASE(testChunked)
+{
+	Mock mock;
+	auto db = DB::MockDatabase::openConnectionTo("pqmock");
+	BOOST_REQUIRE(db);
+	DB::TablePatch tp;
+	tp.src = "source";
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	tp.chunkSize = 1;
+	tp.chunkBoundary = DB::PatchChunkBoundary::Savepoint;
+	db->beginTx();
+	auto r = db->patchTable(&tp);
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(2, r.deletes);
+	BOOST_REQUIRE_EQUAL(2, r.inserts);
+	BOOST_REQUIRE_EQUAL(1, r.updates);
+	BOOST_REQUIRE(!tp.where);
+	BOOST_REQUIRE(!tp.srcExpr);
+}
+
+BOOST_AUTO_TEST_CASE(testChunkedCommits)
+{
+	Mock mock;
+	BindInt s("(SELECT s.* FROM source s WHERE s.a = ?)", 1);
+	auto db = DB::MockDatabase::openConnectionTo("pqmock");
+	BOOST_REQUIRE(db);
+	DB::TablePatch tp;
+	tp.srcExpr = &s;
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	tp.chunkSize = 2;
+	tp.chunkBoundary = DB::PatchChunkBoundary::Commit;
+	// Never commits the caller's transaction
+	db->beginTx();
+	BOOST_REQUIRE_THROW(db->patchTable(&tp), DB::TransactionAlreadyOpen);
+	db->rollbackTx();
+	auto r = db->patchTable(&tp);
+	BOOST_REQUIRE(!db->inTx());
+	BOOST_REQUIRE_EQUAL(2, r.deletes);
+	BOOST_REQUIRE_EQUAL(1, r.inserts);
+	BOOST_REQUIRE_EQUAL(1, r.updates);
+	// Each chunk was committed as it went
+	auto r2 = db->patchTable(&tp);
+	BOOST_REQUIRE_EQUAL(0, r2.deletes);
+	BOOST_REQUIRE_EQUAL(0, r2.inserts);
+	BOOST_REQUIRE_EQUAL(0, r2.updates);
+}
+
+class MockPool : public Mock, public DB::ConnectionPool {
+public:
+	MockPool() : DB::ConnectionPool(4, 2, "postgresql", "user=postgres dbname=" + databaseName()) { }
+};
+
+BOOST_AUTO_TEST_CASE(testParallel)
+{
+	MockPool pool;
+	DB::TablePatch tp;
+	tp.src = "source";
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	auto r = DB::parallelPatchTable(pool, tp, 3);
+	BOOST_REQUIRE_EQUAL(2, r.deletes);
+	BOOST_REQUIRE_EQUAL(2, r.inserts);
+	BOOST_REQUIRE_EQUAL(1, r.updates);
+	BOOST_REQUIRE_EQUAL(0, pool.inUseCount());
+	auto r2 = DB::parallelPatchTable(pool, tp, 3);
+	BOOST_REQUIRE_EQUAL(0, r2.deletes);
+	BOOST_REQUIRE_EQUAL(0, r2.inserts);
+	BOOST_REQUIRE_EQUAL(0, r2.updates);
+}
+
+BOOST_AUTO_TEST_CASE(testUpsert)
+{
+	Mock mock;
+	auto db = DB::MockDatabase::openConnectionTo("pqmock");
+	BOOST_REQUIRE(db);
+	DB::TablePatch tp;
+	tp.src = "source";
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	tp.upsert = true;
+	db->beginTx();
+	auto r = db->patchTable(&tp);
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(2, r.deletes);
+	// Counted as upserts by connections that support them, separately otherwise
+	BOOST_REQUIRE_EQUAL(3, r.updates + r.inserts + r.upserts);
+	db->beginTx();
+	auto r2 = db->patchTable(&tp);
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(0, r2.deletes);
+	BOOST_REQUIRE_EQUAL(0, r2.updates + r2.inserts + r2.upserts);
+}
+
+// Claims RETURNING support for the PostgreSQL connections it routes to
+class ReturningRouter : public DB::ReadWriteRouter {
+public:
+	using DB::ReadWriteRouter::ReadWriteRouter;
+
+	DB::ReturningStyle
+	returningStyle() const override
+	{
+		return DB::ReturningStyle::Returning;
+	}
+};
+
+// Claims ON CONFLICT upsert support for the PostgreSQL connections it routes to
+class OnConflictRouter : public DB::ReadWriteRouter {
+public:
+	using DB::ReadWriteRouter::ReadWriteRouter;
+
+	DB::BulkUpsertStyle
+	bulkUpsertStyle() const override
+	{
+		return DB::BulkUpsertStyle::OnConflict;
+	}
+};
+
+static void
+checkTargetMatchesSource(DB::Connection & db)
+{
+	using Row = std::tuple<int64_t, int64_t, std::string, std::string>;
+	const std::vector<Row> expected {
+			{1, 1, "one", "one"}, {1, 2, "onev2", "twov2"}, {1, 3, "one", "three"}, {3, 1, "three", "one"}};
+	std::vector<Row> rows;
+	db.select("SELECT a, b, c, d FROM target ORDER BY a, b")
+			->forEachRow<int64_t, int64_t, std::string, std::string>([&rows](auto a, auto b, auto c, auto d) {
+				rows.emplace_back(a, b, c, d);
+			});
+	BOOST_REQUIRE(rows == expected);
+}
+
+BOOST_AUTO_TEST_CASE(testUpsertOnConflict)
+{
+	MockPool pool;
+	OnConflictRouter db(pool, pool);
+	DB::TablePatch tp;
+	tp.src = "source";
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	tp.upsert = true;
+	db.beginTx();
+	auto r = db.patchTable(&tp);
+	db.commitTx();
+	BOOST_REQUIRE_EQUAL(2, r.deletes);
+	// 2 inserted and 1 changed; the unchanged row isn't touched
+	BOOST_REQUIRE_EQUAL(3, r.upserts);
+	BOOST_REQUIRE_EQUAL(0, r.updates);
+	BOOST_REQUIRE_EQUAL(0, r.inserts);
+	checkTargetMatchesSource(db);
+}
+
+BOOST_AUTO_TEST_CASE(testUpsertOnConflictWhere)
+{
+	MockPool pool;
+	OnConflictRouter db(pool, pool);
+	WhereAequals1 w;
+	DB::TablePatch tp;
+	tp.src = "source";
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	tp.where = &w;
+	tp.upsert = true;
+	db.beginTx();
+	auto r = db.patchTable(&tp);
+	db.commitTx();
+	// ON CONFLICT can't apply the where clause, so updates and inserts are performed separately
+	BOOST_REQUIRE_EQUAL(0, r.upserts);
+	BOOST_REQUIRE_EQUAL(1, r.updates);
+	BOOST_REQUIRE_EQUAL(2, r.inserts);
+}
+
+BOOST_AUTO_TEST_CASE(testUpsertOnConflictChunked)
+{
+	MockPool pool;
+	OnConflictRouter db(pool, pool);
+	DB::TablePatch tp;
+	tp.src = "source";
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	tp.upsert = true;
+	tp.chunkSize = 1;
+	tp.chunkBoundary = DB::PatchChunkBoundary::Savepoint;
+	db.beginTx();
+	auto r = db.patchTable(&tp);
+	db.commitTx();
+	// Chunking restricts each chunk's source rather than adding a where clause, so still upserts
+	BOOST_REQUIRE_EQUAL(2, r.deletes);
+	BOOST_REQUIRE_EQUAL(3, r.upserts);
+	BOOST_REQUIRE_EQUAL(0, r.updates + r.inserts);
+	BOOST_REQUIRE(!tp.where);
+	checkTargetMatchesSource(db);
+}
+
+BOOST_AUTO_TEST_CASE(testAfterAudit)
+{
+	MockPool pool;
+	DB::TablePatch tp;
+	tp.src = "source";
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	unsigned int deleted = 0, updated = 0, inserted = 0;
+	tp.afterDelete = [&deleted](const DB::SelectCommandPtr & i) {
+		i->forEachRow<int64_t, int64_t, std::string, std::string>([&deleted](auto a, auto, auto, auto) {
+			BOOST_CHECK_EQUAL(2, a);
+			deleted += 1;
+		});
+	};
+	tp.afterUpdate = [&updated](const DB::SelectCommandPtr & i) {
+		i->forEachRow<int64_t, int64_t, std::string, std::string>([&updated](auto a, auto b, auto c, auto d) {
+			BOOST_CHECK_EQUAL(1, a);
+			BOOST_CHECK_EQUAL(2, b);
+			BOOST_CHECK_EQUAL("onev2", c);
+			BOOST_CHECK_EQUAL("twov2", d);
+			updated += 1;
+		});
+	};
+	tp.afterInsert = [&inserted](const DB::SelectCommandPtr & i) {
+		// Rows the audit doesn't fetch are still counted
+		BOOST_CHECK(i->fetch());
+		inserted += 1;
+	};
+	{
+		// Without RETURNING, the affected rows can't be audited afterwards
+		auto db = pool.get();
+		db->beginTx();
+		auto r = db->patchTable(&tp);
+		db->rollbackTx();
+		BOOST_REQUIRE_EQUAL(2, r.deletes);
+		BOOST_REQUIRE_EQUAL(0, deleted + updated + inserted);
+	}
+	ReturningRouter db(pool, pool);
+	db.beginTx();
+	auto r = db.patchTable(&tp);
+	db.commitTx();
+	BOOST_REQUIRE_EQUAL(2, deleted);
+	BOOST_REQUIRE_EQUAL(1, updated);
+	BOOST_REQUIRE_EQUAL(1, inserted);
+	BOOST_REQUIRE_EQUAL(2, r.deletes);
+	BOOST_REQUIRE_EQUAL(2, r.inserts);
+	BOOST_REQUIRE_EQUAL(1, r.updates);
+}
+
+BOOST_AUTO_TEST_CASE(testRowHash)
+{
+	Mock mock;
+	auto db = DB::MockDatabase::openConnectionTo("pqmock");
+	BOOST_REQUIRE(db);
+	DB::TablePatch tp;
+	tp.src = "source";
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	tp.rowHash = "md5(ROW(%1%.c, %1%.d)::text)";
+	db->beginTx();
+	auto r = db->patchTable(&tp);
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(2, r.deletes);
+	BOOST_REQUIRE_EQUAL(2, r.inserts);
+	BOOST_REQUIRE_EQUAL(1, r.updates);
+	tp.verifyRowHash = true;
+	db->beginTx();
+	auto r2 = db->patchTable(&tp);
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(0, r2.deletes);
+	BOOST_REQUIRE_EQUAL(0, r2.inserts);
+	BOOST_REQUIRE_EQUAL(0, r2.updates);
+}
+
+BOOST_AUTO_TEST_CASE(testPrepared)
+{
+	Mock mock;
+	auto db = DB::MockDatabase::openConnectionTo("pqmock");
+	BOOST_REQUIRE(db);
+	DB::TablePatch tp;
+	tp.src = "source";
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	DB::PreparedTablePatch prepared(*db, tp);
+	BOOST_REQUIRE_THROW(prepared.execute(), DB::TransactionRequired);
+	db->beginTx();
+	auto r = prepared.execute();
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(2, r.deletes);
+	BOOST_REQUIRE_EQUAL(2, r.inserts);
+	BOOST_REQUIRE_EQUAL(1, r.updates);
+	db->execute("UPDATE source SET c = 'changed' WHERE a = 3");
+	db->beginTx();
+	auto r2 = prepared.execute();
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(0, r2.deletes);
+	BOOST_REQUIRE_EQUAL(0, r2.inserts);
+	BOOST_REQUIRE_EQUAL(1, r2.updates);
+	tp.chunkSize = 2;
+	BOOST_REQUIRE_THROW((DB::PreparedTablePatch {*db, tp}), DB::PatchCheckFailure);
+}
+
+BOOST_AUTO_TEST_CASE(testWatermark)
+{
+	Mock mock;
+	auto db = DB::MockDatabase::openConnectionTo("pqmock");
+	BOOST_REQUIRE(db);
+	DB::TablePatch tp;
+	tp.src = "source";
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	tp.doDeletes = false;
+	// Treat b as the watermark column; only source rows with b > 1 are considered
+	tp.watermark = "b";
+	tp.lastWatermark = int64_t {1};
+	db->beginTx();
+	auto r = db->patchTable(&tp);
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(0, r.deletes);
+	BOOST_REQUIRE_EQUAL(1, r.inserts);
+	BOOST_REQUIRE_EQUAL(1, r.updates);
+	BOOST_REQUIRE_EQUAL(3, std::get<int64_t>(tp.lastWatermark));
+	db->beginTx();
+	auto r2 = db->patchTable(&tp);
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(0, r2.inserts);
+	BOOST_REQUIRE_EQUAL(0, r2.updates);
+	// An occasional full pass picks up everything else
+	tp.doDeletes = true;
+	tp.lastWatermark = nullptr;
+	db->beginTx();
+	auto r3 = db->patchTable(&tp);
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(2, r3.deletes);
+	BOOST_REQUIRE_EQUAL(1, r3.inserts);
+	BOOST_REQUIRE_EQUAL(0, r3.updates);
+}
+
+BOOST_AUTO_TEST_CASE(testMergePatch)
+{
+	Mock mock;
+	auto db = DB::MockDatabase::openConnectionTo("pqmock");
+	BOOST_REQUIRE(db);
+	DB::TablePatch tp;
+	tp.dest = "target";
+	tp.cols = {"a", "b", "c", "d"};
+	tp.pk = {"a", "b"};
+	const std::vector<std::tuple<int64_t, int64_t, std::string, std::string>> source {
+			{1, 1, "one", "one"}, {1, 2, "onev2", "twov2"}, {1, 3, "one", "three"}, {3, 1, "three", "one"}};
+	db->beginTx();
+	auto r = DB::mergePatchTable<2>(*db, tp, source, {.deleteBatch = 1, .insertOptions = {}});
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(2, r.deletes);
+	BOOST_REQUIRE_EQUAL(2, r.inserts);
+	BOOST_REQUIRE_EQUAL(1, r.updates);
+	db->beginTx();
+	auto r2 = DB::mergePatchTable<2>(*db, tp, source);
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(0, r2.deletes);
+	BOOST_REQUIRE_EQUAL(0, r2.inserts);
+	BOOST_REQUIRE_EQUAL(0, r2.updates);
+}
+
+BOOST_AUTO_TEST_CASE(testMergePatchTextKeys)
+{
+	Mock mock;
+	auto db = DB::MockDatabase::openConnectionTo("pqmock");
+	BOOST_REQUIRE(db);
+	DB::TablePatch tp;
+	tp.dest = "text_target";
+	tp.cols = {"k", "v"};
+	tp.pk = {"k"};
+	// Byte order, as std::string's operator< and the key's "C" collation agree: upper case first
+	const std::vector<std::tuple<std::string, std::string>> source {{"B", "b"}, {"a", "a"}, {"b", "b"}};
+	db->beginTx();
+	auto r = DB::mergePatchTable<1>(*db, tp, source);
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(1, r.deletes);
+	BOOST_REQUIRE_EQUAL(1, r.inserts);
+	BOOST_REQUIRE_EQUAL(1, r.updates);
+	std::vector<std::tuple<std::string, std::string>> rows;
+	db->select("SELECT k, v FROM text_target ORDER BY k")
+			->forEachRow<std::string, std::string>([&rows](auto k, auto v) {
+				rows.emplace_back(k, v);
+			});
+	BOOST_REQUIRE(rows == source);
+	// Sorted as a locale aware collation would, which the merge can't follow
+	const std::vector<std::tuple<std::string, std::string>> localeOrder {{"a", "a"}, {"b", "b"}, {"B", "b"}};
+	db->beginTx();
+	BOOST_REQUIRE_THROW(DB::mergePatchTable<1>(*db, tp, localeOrder), DB::MergePatchOrderMismatch);
+	db->rollbackTx();
+	db->beginTx();
+	auto r2 = DB::mergePatchTable<1>(*db, tp, source);
+	db->commitTx();
+	BOOST_REQUIRE_EQUAL(0, r2.deletes + r2.inserts + r2.updates);
+}
+
+BOOST_AUTO_TEST_CASE(testPatchTables)
+{
+	MockPool pool;
+	std::vector<DB::TablePatch> patches(3);
+	patches[0].src = "child_source";
+	patches[0].dest = "child_target";
+	patches[0].cols = {"id", "parent"};
+	patches[0].pk = {"id"};
+	patches[1].src = "parent_source";
+	patches[1].dest = "parent_target";
+	patches[1].cols = {"id", "name"};
+	patches[1].pk = {"id"};
+	patches[2].src = "source";
+	patches[2].dest = "target";
+	patches[2].cols = {"a", "b", "c", "d"};
+	patches[2].pk = {"a", "b"};
+	const DB::PatchDependencies deps {{"child_target", "parent_target"}};
+	{
+		auto db = pool.get();
+		BOOST_REQUIRE_THROW(DB::patchTables(*db, patches, deps), DB::TransactionRequired);
+		db->beginTx();
+		const DB::PatchDependencies cyclic {{"child_target", "parent_target"}, {"parent_target", "child_target"}};
+		BOOST_REQUIRE_THROW(DB::patchTables(*db, patches, cyclic), DB::PatchCheckFailure);
+		const auto r = DB::patchTables(*db, patches, deps);
+		db->commitTx();
+		BOOST_REQUIRE_EQUAL(3, r.size());
+		BOOST_REQUIRE_EQUAL(1, r[0].result.deletes);
+		BOOST_REQUIRE_EQUAL(1, r[0].result.inserts);
+		BOOST_REQUIRE_EQUAL(1, r[1].result.deletes);
+		BOOST_REQUIRE_EQUAL(1, r[1].result.inserts);
+		BOOST_REQUIRE_EQUAL(2, r[2].result.deletes);
+		BOOST_REQUIRE_EQUAL(2, r[2].result.inserts);
+		BOOST_REQUIRE_EQUAL(1, r[2].result.updates);
+	}
+	const auto r2 = DB::patchTables(pool, patches, deps);
+	BOOST_REQUIRE_EQUAL(3, r2.size());
+	for (const auto & tr : r2) {
+		BOOST_REQUIRE_EQUAL(0, tr.result.deletes);
+		BOOST_REQUIRE_EQUAL(0, tr.result.inserts);
+		BOOST_REQUIRE_EQUAL(0, tr.result.updates);
+	}
+	BOOST_REQUIRE_EQUAL(0, pool.inUseCount());
+}
@@ -10,7 +10,10 @@
 #include <boost/date_time/gregorian_calendar.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/static_assert.hpp>
+#include <bufferedInserter.h>
+#include <bulkRowWriter.h>
 #include <connection.h>
+#include <copyTable.h>
 #include <cstdint>
 #include <cstdio>
 #include <definedDirs.h>
@@ -217,6 +220,82 @@ BOOST_AUTO_TEST_CASE(bulkLoadFile)
 	});
 }
 
+BOOST_AUTO_TEST_CASE(copyTableBetweenConnections)
+{
+	auto src = DB::MockDatabase::openConnectionTo("pqmock");
+	auto dest = DB::MockDatabase::openConnectionTo("pqmock");
+	BOOST_REQUIRE_EQUAL(2, DB::copyTable(*src, "SELECT a, b, c, d, e, f FROM forEachRow", *dest, "copytarget"));
+	dest->select("SELECT COUNT(*), COUNT(d), SUM(a) FROM copytarget")->forEachRow<int64_t, int64_t, int64_t>(
+			[](auto n, auto d, auto a) {
+				BOOST_REQUIRE_EQUAL(2, n);
+				BOOST_REQUIRE_EQUAL(1, d);
+				BOOST_REQUIRE_EQUAL(3, a);
+			});
+	dest->select("SELECT COUNT(*) FROM copytarget t, forEachRow s WHERE t.a = s.a AND t.c = s.c AND t.d = s.d AND "
+				 "t.e = s.e AND t.f = s.f")
+			->forEachRow<int64_t>([](auto n) {
+				BOOST_REQUIRE_EQUAL(1, n);
+			});
+}
+
+BOOST_AUTO_TEST_CASE(copyTableSourceFails)
+{
+	auto src = DB::MockDatabase::openConnectionTo("pqmock");
+	auto dest = DB::MockDatabase::openConnectionTo("pqmock");
+	BOOST_REQUIRE_THROW(DB::copyTable(*src, "SELECT * FROM nonexistent", *dest, "copytarget"), DB::Error);
+}
+
+BOOST_AUTO_TEST_CASE(copyTableNoColumns)
+{
+	auto src = DB::MockDatabase::openConnectionTo("pqmock");
+	auto dest = DB::MockDatabase::openConnectionTo("pqmock");
+	BOOST_REQUIRE_THROW(
+			DB::copyTable(*src, "SELECT FROM generate_series(1, 3)", *dest, "copytarget"), DB::ColumnIndexOutOfRange);
+}
+
+BOOST_AUTO_TEST_CASE(bulkRowWriterBlobFormats)
+{
+	const std::vector<unsigned char> blob {'a', 0, '\t', 0xab};
+	std::string hex, escaped;
+	DB::BulkRowWriter hw(hex), ew(escaped, DB::BulkBlobFormat::Escaped);
+	hw.value(blob);
+	hw.endRow();
+	ew.value(blob);
+	ew.endRow();
+	BOOST_CHECK_EQUAL(hex, "\\\\x610009ab\n");
+	BOOST_CHECK_EQUAL(escaped, "a\\0\\t\xab\n");
+}
+
+BOOST_AUTO_TEST_CASE(bufferedInserter)
+{
+	auto db = DB::MockDatabase::openConnectionTo("pqmock");
+	auto count = [&db]() {
+		int64_t n = 0;
+		db->select("SELECT COUNT(*) FROM buffered")->forEachRow<int64_t>([&n](auto c) {
+			n = c;
+		});
+		return n;
+	};
+	DB::BufferedInserterOptions opts;
+	opts.maxRows = 3;
+	db->beginTx();
+	DB::BufferedInserter bi(*db, "buffered", {"a", "b"}, opts);
+	bi.add(1, "one");
+	bi.add(2, std::optional<std::string> {});
+	BOOST_REQUIRE_EQUAL(2, bi.pendingRows());
+	BOOST_REQUIRE_EQUAL(0, count());
+	bi.add(3, "three\twith tab");
+	BOOST_REQUIRE_EQUAL(0, bi.pendingRows());
+	BOOST_REQUIRE_EQUAL(3, count());
+	bi.add(4, "four");
+	bi.commitTx();
+	BOOST_REQUIRE_EQUAL(0, bi.pendingRows());
+	BOOST_REQUIRE_EQUAL(4, count());
+	db->select("SELECT b FROM buffered WHERE a = 3")->forEachRow<std::string>([](auto b) {
+		BOOST_REQUIRE_EQUAL("three\twith tab", b);
+	});
+}
+
 using StringTypes = std::tuple<std::string, std::string_view, Glib::ustring>;
 BOOST_AUTO_TEST_CASE_TEMPLATE(nullBind, Str, StringTypes)
 {
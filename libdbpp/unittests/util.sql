@@ -10,3 +10,5 @@ INSERT INTO foreachrow(a, b, c, f) VALUES(2, 4.3, 'Some text', false);
 
 CREATE TABLE bulk1(a int, b int, c text, d text);
 CREATE TABLE bulk2(a int, b int, c text, d text);
+CREATE TABLE copytarget(a int, b numeric(4,2), c text, d timestamp without time zone, e interval, f boolean);
+CREATE TABLE buffered(a int, b text);
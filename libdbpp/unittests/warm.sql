@@ -0,0 +1,3 @@
+-- Per-connection state set up by ConnectionPool::warm
+CREATE TEMP TABLE warmed(i int);
+INSERT INTO warmed VALUES(1);